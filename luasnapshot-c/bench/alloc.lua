@@ -0,0 +1,34 @@
+-- 分配统计的开销基准测试，比较开启track_alloc前后分配大量小对象的耗时
+-- 用法：lua bench/alloc.lua [每轮分配的对象数量] [重复次数]
+snapshot = require "snapshot"
+
+local n = tonumber(arg and arg[1]) or 1000000
+local rounds = tonumber(arg and arg[2]) or 5
+
+-- 对象保存在一个小的环形表中，以免被LuaJIT的分配下沉优化掉
+local ring = {}
+local function churn()
+	local best = math.huge
+	for _ = 1, rounds do
+		collectgarbage()
+		local t = os.clock()
+		for i = 1, n do
+			ring[i % 64] = {i}
+			ring[i % 64 + 64] = "obj" .. i
+		end
+		best = math.min(best, os.clock() - t)
+	end
+	return best
+end
+
+local plain = churn()
+snapshot.track_alloc(true)
+local s0 = snapshot.alloc_stats()
+local tracked = churn()
+local s1 = snapshot.alloc_stats()
+snapshot.track_alloc(false)
+
+-- 每次调用lua_Alloc的平均开销，释放也经过lua_Alloc
+local calls = (s1.allocs - s0.allocs + s1.frees - s0.frees) / rounds
+print(string.format("%-10s plain %.3f s  tracked %.3f s  %.0f calls/round  %.2f ns/call",
+	jit and jit.version or _VERSION, plain, tracked, calls, (tracked - plain) / calls * 1e9))
@@ -0,0 +1,57 @@
+-- 快照吞吐量基准测试，在不同的Lua版本下对相同的堆进行比较
+-- 用法：lua bench/capture.lua [对象数量] [重复次数]，LuaJIT下用luajit运行
+snapshot = require "snapshot"
+
+local n = tonumber(arg and arg[1]) or 200000
+local rounds = tonumber(arg and arg[2]) or 5
+
+-- 构造堆：带metatable的对象、闭包、嵌套table和挂起的协程
+Entity = {__name = "Entity"}
+Entity.__index = Entity
+heap = {}
+for i = 1, n do
+	local e = setmetatable({id = i, pos = {x = i, y = -i}}, Entity)
+	e.update = function() return e.id end
+	heap[i] = e
+end
+sessions = {}
+for i = 1, n / 100 do
+	local co = coroutine.create(function(ctx)
+		local buf = {ctx}
+		while true do coroutine.yield(buf) end
+	end)
+	coroutine.resume(co, {session = i})
+	sessions[i] = co
+end
+-- LuaJIT中额外构造FFI的cdata
+if jit then
+	local ffi = require "ffi"
+	vectors = {}
+	for i = 1, n / 10 do
+		vectors[i] = ffi.new("double[3]", i, i, i)
+	end
+end
+collectgarbage()
+
+local function bench(name, fn)
+	local best = math.huge
+	local count = 0
+	for _ = 1, rounds do
+		local t = os.clock()
+		count = fn()
+		best = math.min(best, os.clock() - t)
+	end
+	print(string.format("%-10s %-8s %10d objects %8.3f s %12.0f objects/s",
+		jit and jit.version or _VERSION, name, count, best, count / best))
+end
+
+bench("snapshot", function()
+	local S = snapshot.snapshot(_G, "_G")
+	local count = 0
+	for _ in snapshot.nodes(S) do count = count + 1 end
+	snapshot.free(S)
+	return count
+end)
+bench("stats", function()
+	return snapshot.stats(_G).count
+end)
@@ -29,6 +29,8 @@ static __thread struct mem_buff_header* mem_buff_list = NULL;
 static __thread struct mem_buff_header* mem_buff_list_tail = NULL;
 
 static __thread struct lua_gc_node* free_list = NULL;
+// 内存池中正在使用的节点数量，降为0时将内存池归还给系统
+static __thread long live_nodes = 0;
 
 // 存放str内存
 static __thread char* strbuff = NULL;
@@ -82,9 +84,25 @@ static inline void* mem_buff_alloc_size(size_t size)
     }
 }
 
+// 释放内存池的所有内存块，内存池中不能有正在使用的节点
+static void release_mem_buff()
+{
+    free_list = NULL;
+    struct mem_buff_header* header = mem_buff_list;
+    struct mem_buff_header* next_header = NULL;
+    while (header != NULL) {
+        next_header = header->next;
+        free(header);
+        header = next_header;
+    }
+    mem_buff_list = NULL;
+    mem_buff_list_tail = NULL;
+}
+
 // 默认内存分配函数
 static struct lua_gc_node* default_alloc()
 {
+    live_nodes++;
     if (free_list == NULL) {
         struct lua_gc_node* ret = (struct lua_gc_node*)mem_buff_alloc_size(sizeof(struct lua_gc_node));
         return ret;
@@ -102,6 +120,9 @@ static void default_free(struct lua_gc_node* node)
         return;
     node->next_sibling = free_list;
     free_list = node;
+    // 所有快照都被释放后，空闲节点不再留在进程中
+    if (--live_nodes == 0)
+        release_mem_buff();
 }
 
 // 分配新节点
@@ -111,45 +132,55 @@ struct lua_gc_node* lua_gc_node_new(int type, const char* typestr,
     struct lua_gc_node* ret = (struct lua_gc_node*)mem_func.alloc();
     memset(ret, 0, sizeof(*ret));
     ret->type = type;
-    snprintf(ret->name, LUA_GC_NODE_NAME_SIZE, "%s:%p", typestr, pointer);
+    ret->count = 1;
+    // typestr为NULL时不生成名称，用于只做统计的快照
+    if (typestr != NULL)
+        snprintf(ret->name, LUA_GC_NODE_NAME_SIZE, "%s:%p", typestr, pointer);
     ret->lua_obj_ptr = pointer;
     return ret;
 }
 
-// 释放节点内存，同时释放自己点的内存
-void lua_gc_node_free(struct lua_gc_node* node)
+static void lua_gc_node_free_recursively(struct lua_gc_node* node)
 {
-    if (node == NULL)
-        return;
     struct lua_gc_node* child = node->first_child;
     struct lua_gc_node* next_child = NULL;
     while (child != NULL) {
         next_child = child->next_sibling;
-        lua_gc_node_free(child);
+        lua_gc_node_free_recursively(child);
         child = next_child;
     }
     mem_func.free(node);
 }
 
+// 释放节点内存，同时释放自己点的内存
+void lua_gc_node_free(struct lua_gc_node* node)
+{
+    if (node == NULL)
+        return;
+    // 如果node是指针索引的表头，先释放索引
+    if (node->hh.tbl != NULL && node->hh.prev == NULL) {
+        struct lua_gc_node* index = node;
+        HASH_CLEAR(hh, index);
+    }
+    lua_gc_node_free_recursively(node);
+}
+
 // 释放所有空闲节点和str内存
 void lua_gc_node_free_all()
 {
-	free_list = NULL;
-    struct mem_buff_header* header = mem_buff_list;
-    struct mem_buff_header* next_header = NULL;
-    while (header != NULL) {
-        next_header = header->next;
-        free(header);
-        header = next_header;
-    }
-    mem_buff_list = NULL;
-    mem_buff_list_tail = NULL;
+    release_mem_buff();
+    live_nodes = 0;
     if (strbuff != NULL)
         free(strbuff);
     strbuff = NULL;
     strbuff_len = 0;
 }
 
+long lua_gc_node_live_count()
+{
+    return live_nodes;
+}
+
 // 统计所有节点的数量（包括空闲和非空闲的节点）
 unsigned int lua_gc_node_count(struct lua_gc_node* node)
 {
@@ -188,6 +219,9 @@ void lua_gc_node_add_child(struct lua_gc_node* father,
 {
     if (father == NULL || son == NULL)
         return;
+    son->parent = father;
+    if (son->type != LUA_GC_NODE_WEAK_TYPE)
+        father->children++;
     if (father->first_child) {
         son->next_sibling = father->first_child;
         father->first_child = son;
@@ -219,6 +253,9 @@ static cJSON* lua_gc_node_to_jsonobject(struct lua_gc_node* node)
     cJSON_AddStringToObject(ret, "name", node->name);
     cJSON_AddNumberToObject(ret, "type", node->type);
     cJSON_AddNumberToObject(ret, "refs", node->refs);
+    cJSON_AddNumberToObject(ret, "size", node->size);
+    if (node->count != 1)
+        cJSON_AddNumberToObject(ret, "count", node->count);
     cJSON_AddStringToObject(ret, "desc", node->desc);
     cJSON_AddStringToObject(ret, "link", node->link);
     cJSON* child_array = cJSON_CreateArray();
@@ -360,7 +397,103 @@ char* lua_gc_node_to_str(struct lua_gc_node* node)
     return strbuff;
 }
 
-// 复制单一node节点,其子节点和兄弟节点将被置NULL
+// 完整link路径（折叠栈）的最大长度
+#define FULL_LINK_SIZE 4096
+
+// 折叠栈的一行，stack为以';'分隔的link路径
+struct folded_entry {
+    char* stack;
+    unsigned long weight;
+    UT_hash_handle hh;
+};
+
+// 将link追加到折叠栈中，';'和换行会破坏折叠栈格式，替换为'_'
+static long folded_stack_push(char* stack, long len, const char* link)
+{
+    if (len > 0 && len < FULL_LINK_SIZE - 1)
+        stack[len++] = ';';
+    while (*link != 0 && len < FULL_LINK_SIZE - 1) {
+        char c = *link++;
+        stack[len++] = (c == ';' || c == '\n') ? '_' : c;
+    }
+    stack[len] = 0;
+    return len;
+}
+
+// 遍历节点及其子节点，将权重累加到相同的折叠栈上
+static void lua_gc_node_to_folded_recursively(struct lua_gc_node* node,
+    struct folded_entry** entries, char* stack, long stack_len, int by_size,
+    bool is_normal_node)
+{
+    long len = folded_stack_push(stack, stack_len, node->link);
+    // 增量/减量snapshot中只统计增/减节点
+    if (is_normal_node || node->is_incr_or_decr != 0) {
+        unsigned long weight = by_size ? node->size : node->count;
+        struct folded_entry* entry = NULL;
+        HASH_FIND_STR(*entries, stack, entry);
+        if (entry == NULL) {
+            entry = (struct folded_entry*)malloc(sizeof(*entry));
+            entry->stack = strdup(stack);
+            entry->weight = 0;
+            HASH_ADD_KEYPTR(hh, *entries, entry->stack, strlen(entry->stack),
+                entry);
+        }
+        entry->weight += weight;
+    }
+    struct lua_gc_node* child = node->first_child;
+    while (child != NULL) {
+        lua_gc_node_to_folded_recursively(child, entries, stack, len, by_size,
+            is_normal_node);
+        child = child->next_sibling;
+    }
+    stack[stack_len] = 0;
+}
+
+static int folded_entry_cmp(struct folded_entry* a, struct folded_entry* b)
+{
+    return strcmp(a->stack, b->stack);
+}
+
+// 以折叠栈(flamegraph)格式输出到文件
+int lua_gc_node_to_folded(struct lua_gc_node* node, FILE* f, int by_size)
+{
+    if (node == NULL || f == NULL)
+        return -1;
+    char stack[FULL_LINK_SIZE] = "";
+    struct folded_entry* entries = NULL;
+    lua_gc_node_to_folded_recursively(node, &entries, stack, 0, by_size,
+        is_normal_or_delta_node(node));
+    HASH_SORT(entries, folded_entry_cmp);
+    struct folded_entry* entry = NULL;
+    struct folded_entry* tmp = NULL;
+    HASH_ITER(hh, entries, entry, tmp)
+    {
+        if (entry->weight > 0)
+            fprintf(f, "%s %lu\n", entry->stack, entry->weight);
+        HASH_DEL(entries, entry);
+        free(entry->stack);
+        free(entry);
+    }
+    return 0;
+}
+
+// 先序遍历中node的下一个节点，不需要额外的栈空间
+struct lua_gc_node* lua_gc_node_next(struct lua_gc_node* root,
+    struct lua_gc_node* node)
+{
+    if (node == NULL)
+        return NULL;
+    if (node->first_child != NULL)
+        return node->first_child;
+    while (node != NULL && node != root) {
+        if (node->next_sibling != NULL)
+            return node->next_sibling;
+        node = node->parent;
+    }
+    return NULL;
+}
+
+// 复制单一node节点,其子节点、兄弟节点和父节点将被置NULL
 struct lua_gc_node* lua_gc_node_copy(struct lua_gc_node* node)
 {
     if (node == NULL)
@@ -369,6 +502,8 @@ struct lua_gc_node* lua_gc_node_copy(struct lua_gc_node* node)
     memcpy((void*)ret, (void*)node, sizeof(*node));
     ret->next_sibling = NULL;
     ret->first_child = NULL;
+    ret->parent = NULL;
+    memset(&ret->hh, 0, sizeof(ret->hh));
     return ret;
 }
 
@@ -382,6 +517,7 @@ struct lua_gc_node* lua_gc_node_copyall(struct lua_gc_node* node)
     struct lua_gc_node* child = node->first_child;
     while (child != NULL) {
         *child_ptr = lua_gc_node_copyall(child);
+        (*child_ptr)->parent = ret;
         child_ptr = &(*child_ptr)->next_sibling;
         child = child->next_sibling;
     }
@@ -394,6 +530,9 @@ static void add_to_hashtable_by_ptr(struct lua_gc_node** htable,
 {
     if (htable == NULL || node == NULL)
         return;
+    // 弱引用的边与被引用对象的节点有相同的lua_obj_ptr，不加入索引
+    if (node->type == LUA_GC_NODE_WEAK_TYPE)
+        return;
     struct lua_gc_node* find_node = NULL;
     HASH_FIND(hh, *htable, &node->lua_obj_ptr, sizeof(node->lua_obj_ptr),
         find_node);
@@ -406,6 +545,121 @@ static void add_to_hashtable_by_ptr(struct lua_gc_node** htable,
     }
 }
 
+// 建立以lua_obj_ptr为键的索引，索引保存在root的hh中，root即为哈希表的表头
+struct lua_gc_node* lua_gc_node_index(struct lua_gc_node* root)
+{
+    if (root == NULL)
+        return NULL;
+    if (root->hh.tbl == NULL) {
+        struct lua_gc_node* htable = NULL;
+        add_to_hashtable_by_ptr(&htable, root);
+    }
+    return root;
+}
+
+// 根据lua对象的指针查找节点
+struct lua_gc_node* lua_gc_node_find(struct lua_gc_node* root,
+    const void* pointer)
+{
+    struct lua_gc_node* htable = lua_gc_node_index(root);
+    struct lua_gc_node* find_node = NULL;
+    if (htable != NULL)
+        HASH_FIND(hh, htable, &pointer, sizeof(pointer), find_node);
+    return find_node;
+}
+
+// link路径索引，以(父节点, link)为键
+struct lua_gc_node_path_key {
+    const struct lua_gc_node* parent;
+    char link[LUA_GC_NODE_LINK_SIZE];
+};
+
+struct lua_gc_node_path {
+    struct lua_gc_node_path_key key;
+    struct lua_gc_node* node;
+    UT_hash_handle hh;
+};
+
+// 建立link路径索引，所有条目一次性分配，第一个条目即为表头
+struct lua_gc_node_path* lua_gc_node_path_index(struct lua_gc_node* root)
+{
+    if (root == NULL)
+        return NULL;
+    unsigned int count = lua_gc_node_count(root);
+    struct lua_gc_node_path* entries = (struct lua_gc_node_path*)calloc(count, sizeof(*entries));
+    struct lua_gc_node_path* index = NULL;
+    struct lua_gc_node_path* entry = entries;
+    struct lua_gc_node_path* find_entry = NULL;
+    struct lua_gc_node* node;
+    for (node = root; node != NULL; node = lua_gc_node_next(root, node)) {
+        entry->key.parent = node == root ? NULL : node->parent;
+        strncpy(entry->key.link, node->link, LUA_GC_NODE_LINK_SIZE - 1);
+        entry->node = node;
+        // 同一父节点下的同名link只保留第一个
+        HASH_FIND(hh, index, &entry->key, sizeof(entry->key), find_entry);
+        if (find_entry == NULL) {
+            HASH_ADD(hh, index, key, sizeof(entry->key), entry);
+            entry++;
+        } else {
+            memset(entry, 0, sizeof(*entry));
+        }
+    }
+    return index;
+}
+
+// 在parent的子节点中查找path，path的第一段是parent下某个子节点的link
+// link中本身可能包含'.'，所以依次尝试以每一个'.'作为分隔，后续路径查找失败时回溯
+static struct lua_gc_node* find_path_from(struct lua_gc_node_path* index,
+    const struct lua_gc_node* parent, const char* start)
+{
+    struct lua_gc_node_path_key key;
+    struct lua_gc_node_path* find_entry = NULL;
+    struct lua_gc_node* node = NULL;
+    const char* end = start;
+    for (;;) {
+        while (*end != 0 && *end != '.')
+            end++;
+        if (end - start < LUA_GC_NODE_LINK_SIZE) {
+            memset(&key, 0, sizeof(key));
+            key.parent = parent;
+            memcpy(key.link, start, end - start);
+            HASH_FIND(hh, index, &key, sizeof(key), find_entry);
+        } else {
+            // 再向后分隔只会更长，不可能匹配
+            return NULL;
+        }
+        if (find_entry != NULL) {
+            if (*end == 0)
+                return find_entry->node;
+            node = find_path_from(index, find_entry->node, end + 1);
+            if (node != NULL)
+                return node;
+        }
+        if (*end == 0)
+            return NULL;
+        end++;
+    }
+}
+
+// 根据link路径查找节点，如"_G.player.camps"
+struct lua_gc_node* lua_gc_node_find_path(struct lua_gc_node_path* index,
+    const char* path)
+{
+    if (index == NULL || path == NULL)
+        return NULL;
+    return find_path_from(index, NULL, path);
+}
+
+// 释放link路径索引
+void lua_gc_node_path_free(struct lua_gc_node_path* index)
+{
+    if (index == NULL)
+        return;
+    struct lua_gc_node_path* entries = index;
+    HASH_CLEAR(hh, index);
+    free(entries);
+}
+
 // 从tbl的desc中取出size
 // 样例desc: (size: 10) -> 10
 static int get_table_size_from_desc(const char* desc)
@@ -424,12 +678,46 @@ static int get_table_size_from_desc(const char* desc)
     return atoi(buff);
 }
 
+// 判断节点是否增长时比较的数量：聚合节点为对象数量，table为元素数量，其余为0
+static int get_growth_size(const struct lua_gc_node* node)
+{
+    if (lua_gc_node_is_aggregate(node))
+        return (int)node->count;
+    if (node->type == LUA_TTABLE_TYPE)
+        return get_table_size_from_desc(node->desc);
+    return 0;
+}
+
+// 与incr的规则一致，判断node相对于base是否是增节点，是则进行标识
+// base为NULL表示node是新增对象，table的size或聚合节点的数量增加也视为增节点
+int lua_gc_node_mark_incr(struct lua_gc_node* node,
+    const struct lua_gc_node* base)
+{
+    if (node == NULL)
+        return 0;
+    if (base == NULL) {
+        node->is_incr_or_decr = 1;
+        strncat(node->desc, "(+)", LUA_GC_NODE_DESC_SIZE - strlen(node->desc) - 1);
+        return 1;
+    }
+    int size1 = get_growth_size(base);
+    int size2 = get_growth_size(node);
+    if (size2 > size1) {
+        snprintf(buff, sizeof(buff), "(+%d)", size2 - size1);
+        node->is_incr_or_decr = 1;
+        strncat(node->desc, buff, LUA_GC_NODE_DESC_SIZE - strlen(node->desc) - 1);
+        return 1;
+    }
+    return 0;
+}
+
 // 根据哈希集求出node2的增节点/或减节点
 static struct lua_gc_node*
 lua_gc_node_incr_or_decr_by_htable(struct lua_gc_node* htable,
     struct lua_gc_node* node, bool is_incr)
 {
-    if (htable == NULL || node == NULL)
+    // 弱引用不会使对象存活，不参与增减量的计算
+    if (htable == NULL || node == NULL || node->type == LUA_GC_NODE_WEAK_TYPE)
         return NULL;
     struct lua_gc_node* find_node = NULL;
     HASH_FIND(hh, htable, &node->lua_obj_ptr, sizeof(node->lua_obj_ptr),
@@ -466,11 +754,13 @@ lua_gc_node_incr_or_decr_by_htable(struct lua_gc_node* htable,
         else if (ret == NULL && !is_incr)
             ret = lua_gc_node_copy(find_node);
         ret->first_child = new_child;
+        for (child = new_child; child != NULL; child = child->next_sibling)
+            child->parent = ret;
     }
-    // 如果类型是table，判断其size是否增加
-    if (node->type == LUA_TTABLE && find_node != NULL) {
-        int tbl1_size = get_table_size_from_desc(find_node->desc);
-        int tbl2_size = get_table_size_from_desc(node->desc);
+    // 如果类型是table，判断其size是否增加，聚合节点则判断其对象数量是否增加
+    if (find_node != NULL) {
+        int tbl1_size = get_growth_size(find_node);
+        int tbl2_size = get_growth_size(node);
         if (tbl2_size > tbl1_size) {
             if (ret == NULL && is_incr)
                 ret = lua_gc_node_copy(node);
@@ -497,13 +787,10 @@ static struct lua_gc_node* lua_gc_node_incr(struct lua_gc_node* node1,
 {
     if (node1 == NULL || node2 == NULL)
         return NULL;
-    struct lua_gc_node* hash_table = NULL;
-    // 先将node1的所有节点添加到哈希集
-    add_to_hashtable_by_ptr(&hash_table, node1);
+    // 先取得node1的索引
+    struct lua_gc_node* hash_table = lua_gc_node_index(node1);
     // 然后根据对node2的每一个节点，都在哈希集中查找对应的节点是否存在，不存在则为增节点
-    struct lua_gc_node* ret = lua_gc_node_incr_or_decr_by_htable(hash_table, node2, true);
-    HASH_CLEAR(hh, hash_table);
-    return ret;
+    return lua_gc_node_incr_or_decr_by_htable(hash_table, node2, true);
 }
 
 static struct lua_gc_node* lua_gc_node_decr(struct lua_gc_node* node1,
@@ -512,12 +799,307 @@ static struct lua_gc_node* lua_gc_node_decr(struct lua_gc_node* node1,
     if (node1 == NULL || node2 == NULL)
         return NULL;
 
-    struct lua_gc_node* hash_table = NULL;
-    // 先将node2的所有节点都添加到哈希表
-    add_to_hashtable_by_ptr(&hash_table, node2);
+    // 先取得node2的索引
+    struct lua_gc_node* hash_table = lua_gc_node_index(node2);
     // 然后根据对node1的每一个节点，都在哈希集中查找对应的节点是否存在，不存在则为减节点
-    struct lua_gc_node* ret = lua_gc_node_incr_or_decr_by_htable(hash_table, node1, false);
-    HASH_CLEAR(hh, hash_table);
+    return lua_gc_node_incr_or_decr_by_htable(hash_table, node1, false);
+}
+
+// 将node的完整link路径写入buf，返回路径长度
+int lua_gc_node_full_link(const struct lua_gc_node* node, char* buf,
+    size_t size)
+{
+    if (buf == NULL || size == 0)
+        return 0;
+    buf[0] = 0;
+    if (node == NULL)
+        return 0;
+    // 从node向上到根节点，依次将link插入到buf的开头
+    size_t len = 0;
+    const struct lua_gc_node* curr = node;
+    while (curr != NULL) {
+        size_t link_len = strlen(curr->link);
+        size_t sep = curr == node ? 0 : 1;
+        if (len + link_len + sep >= size)
+            break;
+        memmove(buf + link_len + sep, buf, len + 1);
+        memcpy(buf, curr->link, link_len);
+        if (sep)
+            buf[link_len] = '.';
+        len += link_len + sep;
+        curr = curr->parent;
+    }
+    return (int)len;
+}
+
+// 将count和size累加到key对应的分组
+struct lua_gc_node_group* lua_gc_node_group_add(
+    struct lua_gc_node_group** groups, const char* key, long count, long size)
+{
+    struct lua_gc_node_group* group = NULL;
+    HASH_FIND_STR(*groups, key, group);
+    if (group == NULL) {
+        group = (struct lua_gc_node_group*)calloc(1, sizeof(*group));
+        group->key = strdup(key);
+        HASH_ADD_KEYPTR(hh, *groups, group->key, strlen(group->key), group);
+    }
+    group->count += count;
+    group->size += size;
+    return group;
+}
+
+static int lua_gc_node_group_cmp(struct lua_gc_node_group* a,
+    struct lua_gc_node_group* b)
+{
+    if (a->count != b->count)
+        return a->count > b->count ? -1 : 1;
+    if (a->size != b->size)
+        return a->size > b->size ? -1 : 1;
+    return strcmp(a->key, b->key);
+}
+
+// 将分组按count、size降序排列
+void lua_gc_node_group_sort(struct lua_gc_node_group** groups)
+{
+    HASH_SORT(*groups, lua_gc_node_group_cmp);
+}
+
+// 释放所有分组
+void lua_gc_node_group_free(struct lua_gc_node_group* groups)
+{
+    struct lua_gc_node_group* group = NULL;
+    struct lua_gc_node_group* tmp = NULL;
+    HASH_ITER(hh, groups, group, tmp)
+    {
+        HASH_DEL(groups, group);
+        free(group->key);
+        free(group);
+    }
+}
+
+// 判断是否是聚合节点
+int lua_gc_node_is_aggregate(const struct lua_gc_node* node)
+{
+    return node->type == LUA_GC_NODE_AGGREGATE_TYPE
+        || (node->count != 1 && node->type != LUA_GC_NODE_WEAK_TYPE);
+}
+
+// 节点类型的名称
+const char* lua_gc_node_typename(int type)
+{
+    switch (type) {
+    case LUA_STRING_TYPE:
+        return "string";
+    case LUA_TTABLE_TYPE:
+        return "table";
+    case LUA_TFUNCTION_TYPE:
+        return "function";
+    case LUA_TUSERDATA_TYPE:
+        return "userdata";
+    case LUA_TTHREAD_TYPE:
+        return "thread";
+    case LUA_GC_NODE_AGGREGATE_TYPE:
+        return "aggregate";
+    case LUA_GC_NODE_UPVALUE_TYPE:
+        return "upvalue";
+    case LUA_GC_NODE_CDATA_TYPE:
+        return "cdata";
+    case LUA_GC_NODE_WEAK_TYPE:
+        return "weak";
+    case LUA_GC_NODE_ROOTS_TYPE:
+        return "roots";
+    default:
+        return "unknown";
+    }
+}
+
+// 将node所属的"类"名称写入buf
+const char* lua_gc_node_class_name(struct lua_gc_node* root,
+    const struct lua_gc_node* node, char* buf, size_t size)
+{
+    if (node == NULL || node->metatable == NULL)
+        return NULL;
+    struct lua_gc_node* mt = lua_gc_node_find(root, node->metatable);
+    if (mt == NULL) {
+        snprintf(buf, size, "metatable:%p", node->metatable);
+        return buf;
+    }
+    // 优先使用metatable的__name
+    const char* name = strstr(mt->desc, "(name: ");
+    if (name != NULL) {
+        name += strlen("(name: ");
+        size_t len = strcspn(name, ")");
+        if (len >= size)
+            len = size - 1;
+        memcpy(buf, name, len);
+        buf[len] = 0;
+        return buf;
+    }
+    lua_gc_node_full_link(mt, buf, size);
+    return buf;
+}
+
+// 按group_by计算node所在的分组名称
+const char* lua_gc_node_group_key(struct lua_gc_node* root,
+    const struct lua_gc_node* node, int group_by, int depth, char* buf,
+    size_t size)
+{
+    switch (group_by) {
+    case LUA_GC_NODE_BY_SOURCE:
+        if (node->type == LUA_TFUNCTION_TYPE && node->desc[0] != 0) {
+            // 去掉增减标识等后缀，只保留(func: src:line)
+            size_t len = strcspn(node->desc, ")") + 1;
+            if (len >= size)
+                len = size - 1;
+            memcpy(buf, node->desc, len);
+            buf[len] = 0;
+            return buf;
+        }
+        break;
+    case LUA_GC_NODE_BY_CLASS:
+        if (lua_gc_node_class_name(root, node, buf, size) != NULL)
+            return buf;
+        break;
+    case LUA_GC_NODE_BY_PATH: {
+        lua_gc_node_full_link(node, buf, size);
+        // 只保留前depth层
+        char* p = buf;
+        int i;
+        for (i = 0; i < depth && p != NULL; ++i) {
+            p = strchr(p, '.');
+            if (p != NULL && i + 1 < depth)
+                p++;
+        }
+        if (p != NULL)
+            *p = 0;
+        return buf;
+    }
+    default:
+        break;
+    }
+    snprintf(buf, size, "%s", lua_gc_node_typename(node->type));
+    return buf;
+}
+
+// 对node1中每一个不在node2中的节点，按sign累加到分组中
+// sign为1时同时统计共同节点的大小变化
+static void lua_gc_node_diff_summary_by_htable(struct lua_gc_node* node1,
+    struct lua_gc_node* node2, int sign, int group_by, int depth,
+    struct lua_gc_node_group** groups)
+{
+    char key[FULL_LINK_SIZE];
+    struct lua_gc_node* node;
+    for (node = node1; node != NULL; node = lua_gc_node_next(node1, node)) {
+        if (node->type == LUA_GC_NODE_WEAK_TYPE || node->type == LUA_GC_NODE_ROOTS_TYPE)
+            continue;
+        struct lua_gc_node* find_node = lua_gc_node_find(node2, node->lua_obj_ptr);
+        if (find_node == NULL) {
+            lua_gc_node_group_key(node1, node, group_by, depth, key, sizeof(key));
+            lua_gc_node_group_add(groups, key, sign * (long)node->count, sign * (long)node->size);
+        } else if (sign > 0 && (find_node->size != node->size || find_node->count != node->count)) {
+            // 聚合节点按数量比较
+            lua_gc_node_group_key(node1, node, group_by, depth, key, sizeof(key));
+            lua_gc_node_group_add(groups, key,
+                (long)node->count - (long)find_node->count,
+                (long)node->size - (long)find_node->size);
+        }
+    }
+}
+
+// 求node1到node2的差别的分组统计
+void lua_gc_node_diff_summary(struct lua_gc_node* node1,
+    struct lua_gc_node* node2, int group_by, int depth,
+    struct lua_gc_node_group** groups)
+{
+    if (node1 == NULL || node2 == NULL || groups == NULL)
+        return;
+    // node2中新增的节点和大小变化的节点
+    lua_gc_node_diff_summary_by_htable(node2, node1, 1, group_by, depth, groups);
+    // node1中减少的节点
+    lua_gc_node_diff_summary_by_htable(node1, node2, -1, group_by, depth,
+        groups);
+    // 去掉没有变化的分组
+    struct lua_gc_node_group* group = NULL;
+    struct lua_gc_node_group* tmp = NULL;
+    HASH_ITER(hh, *groups, group, tmp)
+    {
+        if (group->count == 0 && group->size == 0) {
+            HASH_DEL(*groups, group);
+            free(group->key);
+            free(group);
+        }
+    }
+    lua_gc_node_group_sort(groups);
+}
+
+// 判断node是否在nodes[1]中新增且在之后的所有快照中都存活
+static bool is_survivor(struct lua_gc_node* node, struct lua_gc_node** nodes,
+    int n)
+{
+    if (node->type == LUA_GC_NODE_WEAK_TYPE || node->type == LUA_GC_NODE_ROOTS_TYPE
+        || lua_gc_node_find(nodes[0], node->lua_obj_ptr) != NULL)
+        return false;
+    int i;
+    for (i = 2; i < n; ++i) {
+        if (lua_gc_node_find(nodes[i], node->lua_obj_ptr) == NULL)
+            return false;
+    }
+    return true;
+}
+
+static struct lua_gc_node* lua_gc_node_survivors_recursively(
+    struct lua_gc_node* node, struct lua_gc_node** nodes, int n,
+    struct lua_gc_node_group** ranking, char* link_buff)
+{
+    struct lua_gc_node* ret = NULL;
+    if (is_survivor(node, nodes, n)) {
+        ret = lua_gc_node_copy(node);
+        ret->is_incr_or_decr = 1;
+        strncat(ret->desc, "(+)", LUA_GC_NODE_DESC_SIZE - strlen(ret->desc) - 1);
+        if (ranking != NULL) {
+            lua_gc_node_full_link(node->parent, link_buff, FULL_LINK_SIZE);
+            lua_gc_node_group_add(ranking, link_buff, node->count, node->size);
+        }
+    }
+
+    struct lua_gc_node* child = node->first_child;
+    struct lua_gc_node* new_child = NULL;
+    struct lua_gc_node** new_child_ptr = &new_child;
+    while (child != NULL) {
+        *new_child_ptr = lua_gc_node_survivors_recursively(child, nodes, n,
+            ranking, link_buff);
+        if (*new_child_ptr != NULL)
+            new_child_ptr = &(*new_child_ptr)->next_sibling;
+        child = child->next_sibling;
+    }
+
+    // 存活对象的父节点也需要保留，以保持引用链
+    if (new_child != NULL) {
+        if (ret == NULL)
+            ret = lua_gc_node_copy(node);
+        ret->first_child = new_child;
+        for (child = new_child; child != NULL; child = child->next_sibling)
+            child->parent = ret;
+    }
+    return ret;
+}
+
+// 求出在nodes[1]中新增且在nodes[2..n-1]中都仍然存在的对象
+struct lua_gc_node* lua_gc_node_survivors(struct lua_gc_node** nodes, int n,
+    struct lua_gc_node_group** ranking)
+{
+    if (nodes == NULL || n < 2)
+        return NULL;
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (nodes[i] == NULL)
+            return NULL;
+    }
+    char link_buff[FULL_LINK_SIZE];
+    struct lua_gc_node* ret = lua_gc_node_survivors_recursively(nodes[1], nodes,
+        n, ranking, link_buff);
+    if (ranking != NULL)
+        lua_gc_node_group_sort(ranking);
     return ret;
 }
 
@@ -5,6 +5,7 @@
 extern "C" {
 #endif
 #include "uthash.h"
+#include <stdio.h>
 #define LUA_GC_NODE_NAME_SIZE 32
 #define LUA_GC_NODE_DESC_SIZE 96
 #define LUA_GC_NODE_LINK_SIZE 64
@@ -15,6 +16,11 @@ enum lua_gc_node_type {
     LUA_TFUNCTION_TYPE = 6,
     LUA_TUSERDATA_TYPE = 7,
     LUA_TTHREAD_TYPE = 8,
+    LUA_GC_NODE_AGGREGATE_TYPE = 9, //聚合节点，代表多个未展开的对象
+    LUA_GC_NODE_UPVALUE_TYPE = 10, //Lua闭包的upvalue，被多个闭包共享时只有一个节点
+    LUA_GC_NODE_CDATA_TYPE = 11, //LuaJIT的FFI cdata，lua_type返回的值与upvalue节点冲突
+    LUA_GC_NODE_WEAK_TYPE = 12, //弱引用的边，lua_obj_ptr为被引用的对象，数量和大小为0
+    LUA_GC_NODE_ROOTS_TYPE = 13, //多根快照的虚拟根节点，不代表任何对象，不参与统计
 };
 
 struct lua_gc_node {
@@ -29,16 +35,38 @@ struct lua_gc_node {
 
     struct lua_gc_node* next_sibling; //兄弟节点
     struct lua_gc_node* first_child; //第一个子节点
-    // unsigned long size;			 		//
-    // 该节点所占用内存量，叶子节点是自己节点的内存，非叶子节点是所有子节点的size之和
+    struct lua_gc_node* parent; //父节点，根节点为NULL
+    unsigned long size; //该节点自身所占用内存量的估算值（不包括子节点），聚合节点为所有对象的大小之和
+    unsigned int count; //节点代表的对象数量，普通节点为1，聚合节点为被聚合的对象数量
+    unsigned int children; //子节点的数量，不含弱引用的边，遍历时用于判断是否达到max_children
     const void* lua_obj_ptr; //指向lua对象的指针，唯一标识lua对象
+    const void* metatable; //table和userdata的metatable指针，用于按"类"统计
     UT_hash_handle hh;
 };
 
+// link路径索引
+struct lua_gc_node_path;
+
+// 分组统计的结果，如按类型、按link路径统计的数量和大小
+struct lua_gc_node_group {
+    char* key; //分组名称
+    long count; //对象数量
+    long size; //对象大小之和
+    UT_hash_handle hh;
+};
+
+// 统计时的分组方式
+enum lua_gc_node_group_by {
+    LUA_GC_NODE_BY_TYPE = 0, //按节点类型
+    LUA_GC_NODE_BY_SOURCE = 1, //按函数定义的位置，非函数节点按类型
+    LUA_GC_NODE_BY_CLASS = 2, //按metatable的__name或link路径，没有metatable的按类型
+    LUA_GC_NODE_BY_PATH = 3, //按link路径的前缀
+};
+
 typedef struct lua_gc_node* (*lua_gc_node_alloc_fn)();
 typedef void (*lua_gc_node_free_fn)(struct lua_gc_node*);
 
-// 分配新节点
+// 分配新节点，typestr为NULL时不生成节点名称
 struct lua_gc_node* lua_gc_node_new(int type, const char* typestr,
     const void* pointer);
 // 释放节点内存，同时释放自己点的内存
@@ -47,6 +75,8 @@ void lua_gc_node_free(struct lua_gc_node* node);
 void lua_gc_node_free_all();
 // 统计所有节点的数量
 unsigned int lua_gc_node_count(struct lua_gc_node* node);
+// 当前线程中默认分配函数分配的、尚未释放的节点数量
+long lua_gc_node_live_count();
 // 设置描述
 int lua_gc_node_set_desc(struct lua_gc_node* node, const char* desc);
 // 设置link
@@ -64,10 +94,63 @@ char* lua_gc_node_to_jsonstr(struct lua_gc_node* node);
 char* lua_gc_node_to_jsonstrfmt(struct lua_gc_node* node);
 // 转换成str格式化的字符串，不需要使用free来释放内存
 char* lua_gc_node_to_str(struct lua_gc_node* node);
-// 复制单一node节点,其子节点和兄弟节点将被置NULL
+// 以折叠栈(flamegraph)格式输出到文件，相同的link路径会被合并
+// by_size: 非0时以size为权重，为0时以对象数量为权重
+int lua_gc_node_to_folded(struct lua_gc_node* node, FILE* f, int by_size);
+// 先序遍历中node的下一个节点，遍历范围限定在root子树内，结束时返回NULL
+struct lua_gc_node* lua_gc_node_next(struct lua_gc_node* root,
+    struct lua_gc_node* node);
+// 复制单一node节点,其子节点、兄弟节点和父节点将被置NULL
 struct lua_gc_node* lua_gc_node_copy(struct lua_gc_node* node);
 // 复制node节点及其所有子节点
 struct lua_gc_node* lua_gc_node_copyall(struct lua_gc_node* node);
+// 建立以lua_obj_ptr为键的索引（只在第一次调用时建立），返回哈希表表头
+// 索引随root一起由lua_gc_node_free释放
+struct lua_gc_node* lua_gc_node_index(struct lua_gc_node* root);
+// 根据lua对象的指针查找节点，O(1)
+struct lua_gc_node* lua_gc_node_find(struct lua_gc_node* root,
+    const void* pointer);
+// 建立link路径索引，需要使用lua_gc_node_path_free来释放
+struct lua_gc_node_path* lua_gc_node_path_index(struct lua_gc_node* root);
+// 根据link路径（如"_G.player.camps"）查找节点，link中含有'.'时回溯尝试各种分隔方式
+struct lua_gc_node* lua_gc_node_find_path(struct lua_gc_node_path* index,
+    const char* path);
+// 释放link路径索引
+void lua_gc_node_path_free(struct lua_gc_node_path* index);
+// 与incr的规则一致，判断node相对于base是否是增节点，是则进行标识并返回1
+// base为NULL表示node是新增对象
+int lua_gc_node_mark_incr(struct lua_gc_node* node,
+    const struct lua_gc_node* base);
+// 将node的完整link路径（如"_G.player.camps"）写入buf
+int lua_gc_node_full_link(const struct lua_gc_node* node, char* buf,
+    size_t size);
+// 将count和size累加到key对应的分组，分组不存在时创建
+struct lua_gc_node_group* lua_gc_node_group_add(
+    struct lua_gc_node_group** groups, const char* key, long count, long size);
+// 将分组按count、size降序排列
+void lua_gc_node_group_sort(struct lua_gc_node_group** groups);
+// 释放所有分组
+void lua_gc_node_group_free(struct lua_gc_node_group* groups);
+// 判断是否是聚合节点
+int lua_gc_node_is_aggregate(const struct lua_gc_node* node);
+// 节点类型的名称，如"table"
+const char* lua_gc_node_typename(int type);
+// 将node所属的"类"名称写入buf：metatable的__name，没有__name时为metatable的link路径
+// 没有metatable时返回NULL
+const char* lua_gc_node_class_name(struct lua_gc_node* root,
+    const struct lua_gc_node* node, char* buf, size_t size);
+// 按group_by计算node所在的分组名称，depth为按link路径分组时的前缀层数
+const char* lua_gc_node_group_key(struct lua_gc_node* root,
+    const struct lua_gc_node* node, int group_by, int depth, char* buf,
+    size_t size);
+// 求node1到node2的差别的分组统计，count和size为增减量，不生成增量/减量节点
+void lua_gc_node_diff_summary(struct lua_gc_node* node1,
+    struct lua_gc_node* node2, int group_by, int depth,
+    struct lua_gc_node_group** groups);
+// 求出在nodes[1]中新增（不在nodes[0]中）且在nodes[2..n-1]中都仍然存在的对象
+// ranking不为NULL时，按所在容器的link路径统计存活对象的数量和大小
+struct lua_gc_node* lua_gc_node_survivors(struct lua_gc_node** nodes, int n,
+    struct lua_gc_node_group** ranking);
 // 求node1到node2的差别
 // incr: 指向增加的对象的指针, 为null时不进行增量计算
 // decr: 指向减少的对象的指针, 为null时不进行减量计算
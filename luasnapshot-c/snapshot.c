@@ -5,10 +5,28 @@ extern "C" {
 #include "lua_gc_node.h"
 #include <lauxlib.h>
 #include <lua.h>
+#include <limits.h>
 #include <lualib.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SNAPSHOT_CONTROL
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 #define SNAPSHOT_METATABLE "_snapshot_metatable_"
-#define lua_equal(L,idx1,idx2)		lua_compare(L,(idx1),(idx2),LUA_OPEQ)
 
 static void traverse_object(lua_State* L, lua_State* dL,
     struct lua_gc_node* parent, const char* link);
@@ -23,6 +41,20 @@ static void traverse_thread(lua_State* L, lua_State* dL,
 
 static __thread char buff[128];
 
+// Lua函数描述"(func: source:line)"的缓存，以源文件名的指针和定义的行号为key，在同一线程的多次快照之间保留。
+// 同一原型的闭包共用一项，命中时不再格式化描述。源文件名的字符串被回收后指针可能被复用，
+// 所以命中时还要比较short_src，描述只由short_src和行号决定，比较相同时描述一定正确
+#define FUNC_DESC_CACHE_SIZE 256
+
+struct func_desc {
+    const char* source;
+    int linedefined;
+    char short_src[LUA_IDSIZE];
+    char desc[LUA_GC_NODE_DESC_SIZE];
+};
+
+static __thread struct func_desc func_desc_cache[FUNC_DESC_CACHE_SIZE];
+
 #if LUA_VERSION_NUM == 501
 static void luaL_checkversion(lua_State* L)
 {
@@ -34,7 +66,7 @@ static void luaL_checkversion(lua_State* L)
 
 static void lua_rawsetp(lua_State* L, int idx, const void* p)
 {
-    if (idx < 0) {
+    if (idx < 0 && idx > LUA_REGISTRYINDEX) {
         idx += lua_gettop(L) + 1;
     }
     lua_pushlightuserdata(L, (void*)p);
@@ -44,7 +76,7 @@ static void lua_rawsetp(lua_State* L, int idx, const void* p)
 
 static void lua_rawgetp(lua_State* L, int idx, const void* p)
 {
-    if (idx < 0) {
+    if (idx < 0 && idx > LUA_REGISTRYINDEX) {
         idx += lua_gettop(L) + 1;
     }
     lua_pushlightuserdata(L, (void*)p);
@@ -53,11 +85,16 @@ static void lua_rawgetp(lua_State* L, int idx, const void* p)
 
 static void lua_getuservalue(lua_State* L, int idx) { lua_getfenv(L, idx); }
 
+#define lua_rawlen(L, idx) lua_objlen(L, (idx))
+#define luaL_newlib(L, l) (lua_newtable(L), luaL_register(L, NULL, l))
+
+// 遍历栈顶函数的环境表，不弹出函数
+// 绝大多数函数的环境都是全局表，它不作为每个函数的子节点重复记录
 static void mark_function_env(lua_State* L, lua_State* dL,
     struct lua_gc_node* parent)
 {
     lua_getfenv(L, -1);
-    if (lua_istable(L, -1)) {
+    if (lua_istable(L, -1) && !lua_rawequal(L, -1, LUA_GLOBALSINDEX)) {
         traverse_object(L, dL, parent, "[environment]");
     } else {
         lua_pop(L, 1);
@@ -65,9 +102,11 @@ static void mark_function_env(lua_State* L, lua_State* dL,
 }
 
 #define is_lightcfunction(L, idx) (0)
+#define is_global_env(L, idx) lua_rawequal(L, (idx), LUA_GLOBALSINDEX)
 
 #else
 #define mark_function_env(L, dL, t)
+#define is_global_env(L, idx) (0)
 
 static int is_lightcfunction(lua_State* L, int idx)
 {
@@ -81,9 +120,14 @@ static int is_lightcfunction(lua_State* L, int idx)
 }
 #endif
 
-#include <stdbool.h>
-#include <stdio.h>
-#include <string.h>
+// LuaJIT的lualib.h中定义了ffi库的名称，LuaJIT在Lua 5.1的API之外还提供了
+// lua_upvalueid，并且有FFI的cdata类型
+#ifdef LUA_FFILIBNAME
+#define SNAPSHOT_LUAJIT
+#ifndef LUA_TCDATA
+#define LUA_TCDATA 10
+#endif
+#endif
 
 #define TABLE 1
 #define FUNCTION 2
@@ -91,6 +135,187 @@ static int is_lightcfunction(lua_State* L, int idx)
 #define THREAD 4
 #define USERDATA 5
 #define GC_NODE 6
+#define CONTEXT 7
+
+// 各类GC对象所占内存的估算值（以64位下的结构体大小为准）
+#ifdef SNAPSHOT_LUAJIT
+// LuaJIT的TValue为8字节，table的节点更小
+#define TABLE_HEADER_SIZE 64
+#define TABLE_ENTRY_SIZE 24
+// GCcdata的头部，数据部分的大小由ffi.sizeof得到
+#define CDATA_HEADER_SIZE 16
+#else
+#define TABLE_HEADER_SIZE 56
+#define TABLE_ENTRY_SIZE 32
+#endif
+#define CLOSURE_HEADER_SIZE 32
+#define UPVALUE_SIZE 16
+#define USERDATA_HEADER_SIZE 40
+#define USERVALUE_SIZE 16
+#define THREAD_SIZE 208
+
+// 按节点类型统计的数组大小
+#define NODE_TYPE_COUNT (LUA_GC_NODE_CDATA_TYPE + 1)
+
+// 抽样统计时，数组部分不小于该长度的table视为容器，总是展开
+#define SAMPLE_CONTAINER_SIZE 64
+// compact为true时，折叠为聚合节点所需的最少同类兄弟节点数量
+#define COMPACT_DEFAULT_RUN 16
+
+// 多根快照中跨越根对象的引用，from和to为完整的link路径
+struct cross_edge {
+    char* from;
+    char* to;
+    struct cross_edge* next;
+};
+
+// 快照中仍然存活的采样对象，记录其节点和分配时的调用栈
+struct alloc_site {
+    struct lua_gc_node* node;
+    char* stack; //分配时的调用栈，没有记录时为NULL
+    struct alloc_site* next;
+};
+
+// 只做统计时的已访问集合，以对象指针为key的开放寻址哈希表，
+// 代替dL中的GC_NODE表，省去Lua API的调用和每个对象一个table项的开销
+struct visited_set {
+    const void** slots;
+    size_t mask; //容量减1，容量为2的幂
+    size_t count;
+};
+
+// 按metatable统计的实例数量和大小
+struct class_count {
+    const void* metatable;
+    char* name; //metatable的__name字段
+    long count;
+    long size;
+    UT_hash_handle hh;
+};
+
+// 遍历过程中的状态，以lightuserdata的形式保存在dL的CONTEXT位置
+struct traverse_context {
+    struct lua_gc_node* baseline; //不为NULL时只保留相对baseline新增的对象和增长的table
+    struct class_count* class_counts; //遍历过程中按metatable统计的实例
+    struct lua_gc_node_group* classes; //遍历结束后按类名统计的实例
+    bool stats_only; //只做统计，不生成节点树和link
+    struct visited_set visited; //只做统计时的已访问集合
+    struct lua_gc_node* spare_nodes; //只做统计时已遍历完的节点，节点按调用栈的顺序创建和释放，可以复用
+    long type_counts[NODE_TYPE_COUNT]; //只做统计时，按类型统计的数量
+    long type_sizes[NODE_TYPE_COUNT]; //只做统计时，按类型统计的大小
+    struct lua_gc_node_group* sources; //只做统计时，按函数定义位置统计的数量
+    int depth; //当前正在遍历的节点的深度，根节点为0
+    int sample; //抽样统计时的抽样间隔k，即深度不小于sample_depth的table只展开约1/k
+    int sample_depth; //小于该深度的table总是展开
+    struct lua_gc_node* unit; //当前所在的抽样单元(被抽中的table)，其子树中的对象权重为k
+    long unit_counts[NODE_TYPE_COUNT]; //当前抽样单元中按类型统计的数量
+    long unit_sizes[NODE_TYPE_COUNT]; //当前抽样单元中按类型统计的大小
+    double count_vars[NODE_TYPE_COUNT]; //按类型统计的数量的方差估计
+    double size_vars[NODE_TYPE_COUNT]; //按类型统计的大小的方差估计
+    double total_count_var; //总数量的方差估计
+    double total_size_var; //总大小的方差估计
+    int depth_limit; //大于0时，深度不小于该值的对象不再展开
+    unsigned int max_children; //大于0时，每个节点最多展开的子节点数量，其余的汇总为一个聚合节点
+    const void** excludes; //不展开的对象，在遍历前标识为已访问
+    int nexcludes;
+    unsigned int compact; //大于0时，连续该数量以上的同类数组元素折叠为聚合节点
+    struct lua_gc_node* roots; //多根快照时的虚拟根节点，每个根对象为其子节点
+    struct cross_edge* cross_edges; //多根快照时，从一个根对象的子树指向另一个根对象的子树的引用
+    const void* globals; //_G表，只在link为"_G"时展开
+    struct alloc_site* alloc_sites; //遍历结束后与节点对应的采样对象
+    lua_State* L; //调用snapshot的线程，遍历中的错误在该线程中抛出，LuaJIT中cdata的大小也只能在该线程中计算
+};
+
+static inline struct traverse_context* get_context(lua_State* dL)
+{
+    return (struct traverse_context*)lua_touserdata(dL, CONTEXT);
+}
+
+// 确保L的栈上还有n个空位。L可能是挂起的协程，不能在其中抛出错误，
+// 所以用lua_checkstack检查，失败时在调用snapshot的线程中报错
+static void check_stack(lua_State* L, lua_State* dL, int n)
+{
+    if (!lua_checkstack(L, n))
+        luaL_error(get_context(dL)->L, "stack overflow (snapshot traversal)");
+}
+
+// 是否是会生成节点的GC对象，字符串不生成节点
+static inline bool is_collectable(int type)
+{
+    return type == LUA_TTABLE || type == LUA_TFUNCTION || type == LUA_TUSERDATA
+        || type == LUA_TTHREAD
+#ifdef SNAPSHOT_LUAJIT
+        || type == LUA_TCDATA
+#endif
+        ;
+}
+
+// 返回p在集合中的位置，不存在时为插入的位置
+static size_t visited_slot(const struct visited_set* set, const void* p)
+{
+    uint64_t x = (uint64_t)(uintptr_t)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    size_t i = (size_t)x & set->mask;
+    while (set->slots[i] != NULL && set->slots[i] != p)
+        i = (i + 1) & set->mask;
+    return i;
+}
+
+static bool visited_contains(const struct visited_set* set, const void* p)
+{
+    return set->slots != NULL && set->slots[visited_slot(set, p)] != NULL;
+}
+
+// 加入集合，装载率超过1/2时容量翻倍
+static void visited_add(struct visited_set* set, const void* p)
+{
+    if (set->slots == NULL || (set->count + 1) * 2 > set->mask + 1) {
+        const void** old = set->slots;
+        size_t old_size = old != NULL ? set->mask + 1 : 0;
+        size_t size = old != NULL ? old_size * 2 : 4096;
+        set->slots = (const void**)calloc(size, sizeof(const void*));
+        set->mask = size - 1;
+        size_t i;
+        for (i = 0; i < old_size; ++i) {
+            if (old[i] != NULL)
+                set->slots[visited_slot(set, old[i])] = old[i];
+        }
+        free(old);
+    }
+    size_t i = visited_slot(set, p);
+    if (set->slots[i] == NULL) {
+        set->slots[i] = p;
+        set->count++;
+    }
+}
+
+// 在GC_NODE表中记录对象p对应的节点，node为NULL时只标识为已访问
+// 先压入key再压入value，Lua 5.1中不需要lua_rawsetp的模拟实现所需的lua_insert
+static inline void set_gc_node(lua_State* dL, const void* p, struct lua_gc_node* node)
+{
+    struct traverse_context* ctx = get_context(dL);
+    if (ctx->stats_only) {
+        visited_add(&ctx->visited, p);
+        return;
+    }
+    lua_pushlightuserdata(dL, (void*)p);
+    if (node != NULL)
+        lua_pushlightuserdata(dL, (void*)node);
+    else
+        lua_pushboolean(dL, 1);
+    lua_rawset(dL, GC_NODE);
+}
+
+// snapshot(userdata)对象的内存布局，root必须是第一个成员
+struct snapshot_data {
+    struct lua_gc_node* root; //快照的根节点
+    struct lua_gc_node_path* paths; //link路径索引，在第一次使用时建立
+    struct lua_gc_node_group* classes; //按类统计的实例，快照时生成或在第一次使用时建立
+    struct cross_edge* cross_edges; //多根快照中跨越根对象的引用
+    struct alloc_site* alloc_sites; //开启分配采样时，快照中仍然存活的采样对象
+};
 
 // 根据TValue的tt字段，返回对应的类型字符串
 /*
@@ -105,23 +330,277 @@ static struct lua_gc_node* gen_node(lua_State* L, lua_State* dL,
     const char* link)
 {
     int type = lua_type(L, -1);
+#ifdef SNAPSHOT_LUAJIT
+    if (type == LUA_TCDATA)
+        type = LUA_GC_NODE_CDATA_TYPE;
+#endif
     const void* p = lua_topointer(L, -1);
-    // 创建新的节点
-    struct lua_gc_node* new_node = lua_gc_node_new(type, lua_typename(L, type), p);
+    struct traverse_context* ctx = get_context(dL);
+    // 创建新的节点，只做统计时节点只在遍历期间存在，不需要名称，复用已遍历完的节点
+    struct lua_gc_node* new_node = ctx->spare_nodes;
+    if (ctx->stats_only && new_node != NULL) {
+        ctx->spare_nodes = new_node->next_sibling;
+        new_node->type = type;
+        new_node->lua_obj_ptr = p;
+        new_node->next_sibling = NULL;
+        new_node->size = 0;
+        new_node->metatable = NULL;
+        new_node->desc[0] = 0;
+        new_node->children = 0;
+    } else {
+        new_node = lua_gc_node_new(type, ctx->stats_only ? NULL : lua_gc_node_typename(type), p);
+    }
+    ctx->depth++;
     // 初始化引用量为1
     new_node->refs = 1;
     // 复制链接
     strncpy(new_node->link, link, LUA_GC_NODE_LINK_SIZE - 1);
     // 添加到父节点的子节点列表
     lua_gc_node_add_child(parent, new_node);
-    /* TODO 添加对size字段的计算 */
 
-    // 添加节点到GC_NODE表
-    lua_pushlightuserdata(dL, (void*)new_node);
-    lua_rawsetp(dL, GC_NODE, (const void*)p);
+    // 添加节点到GC_NODE表，只做统计时只需要标识为已访问
+    set_gc_node(dL, p, ctx->stats_only ? NULL : new_node);
     return new_node;
 }
 
+// 查找或创建metatable对应的统计项
+static struct class_count* find_class(struct traverse_context* ctx,
+    const void* metatable)
+{
+    struct class_count* cc = NULL;
+    HASH_FIND_PTR(ctx->class_counts, &metatable, cc);
+    if (cc == NULL) {
+        cc = (struct class_count*)calloc(1, sizeof(*cc));
+        cc->metatable = metatable;
+        HASH_ADD_PTR(ctx->class_counts, metatable, cc);
+    }
+    return cc;
+}
+
+// 记录栈顶的metatable，第一次遇到时读取其__name字段作为类名
+static void note_class(lua_State* L, struct traverse_context* ctx,
+    struct lua_gc_node* node)
+{
+    node->metatable = lua_topointer(L, -1);
+    struct class_count* cc = find_class(ctx, node->metatable);
+    if (cc->count > 0 || cc->name != NULL)
+        return;
+    lua_pushliteral(L, "__name");
+    lua_rawget(L, -2);
+    if (lua_type(L, -1) == LUA_TSTRING)
+        cc->name = strdup(lua_tostring(L, -1));
+    lua_pop(L, 1);
+}
+
+// 按metatable累加实例的数量和大小，weight为抽样统计时的权重
+static void count_class(struct traverse_context* ctx,
+    struct lua_gc_node* node, long weight)
+{
+    struct class_count* cc = find_class(ctx, node->metatable);
+    cc->count += weight;
+    cc->size += node->size * weight;
+}
+
+// 根据指针判断table是否被抽中，同一对象在多次快照中的结果一致
+static bool is_sampled(const void* p, int sample)
+{
+    uint64_t x = (uint64_t)(uintptr_t)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x % (uint64_t)sample == 0;
+}
+
+// 抽样单元遍历结束，按Horvitz-Thompson估计累加方差：每个单元的贡献为k(k-1)y^2
+static void finish_unit(struct traverse_context* ctx)
+{
+    double factor = (double)ctx->sample * (ctx->sample - 1);
+    long count = 0;
+    long size = 0;
+    int i;
+    for (i = 0; i < NODE_TYPE_COUNT; ++i) {
+        ctx->count_vars[i] += factor * ctx->unit_counts[i] * ctx->unit_counts[i];
+        ctx->size_vars[i] += factor * ctx->unit_sizes[i] * ctx->unit_sizes[i];
+        count += ctx->unit_counts[i];
+        size += ctx->unit_sizes[i];
+        ctx->unit_counts[i] = 0;
+        ctx->unit_sizes[i] = 0;
+    }
+    ctx->total_count_var += factor * count * count;
+    ctx->total_size_var += factor * size * size;
+    ctx->unit = NULL;
+}
+
+// 遍历结束后，将按metatable统计的结果转换为按类名统计
+static void resolve_classes(lua_State* dL, struct traverse_context* ctx)
+{
+    char name[LUA_GC_NODE_DESC_SIZE + 256];
+    struct class_count* cc = NULL;
+    struct class_count* tmp = NULL;
+    HASH_ITER(hh, ctx->class_counts, cc, tmp)
+    {
+        struct lua_gc_node* mt = NULL;
+        lua_rawgetp(dL, GC_NODE, cc->metatable);
+        if (lua_islightuserdata(dL, -1))
+            mt = (struct lua_gc_node*)lua_touserdata(dL, -1);
+        lua_pop(dL, 1);
+        if (cc->name != NULL) {
+            snprintf(name, sizeof(name), "%s", cc->name);
+        } else if (mt != NULL) {
+            lua_gc_node_full_link(mt, name, sizeof(name));
+        } else {
+            snprintf(name, sizeof(name), "metatable:%p", cc->metatable);
+        }
+        lua_gc_node_group_add(&ctx->classes, name, cc->count, cc->size);
+        HASH_DEL(ctx->class_counts, cc);
+        free(cc->name);
+        free(cc);
+    }
+    lua_gc_node_group_sort(&ctx->classes);
+}
+
+// 聚合节点的标识，由父节点、类型和metatable决定，在多次快照中保持一致
+// 结果为奇数，不会与lua对象的指针冲突
+static const void* aggregate_ptr(const struct lua_gc_node* parent, int type,
+    const void* metatable)
+{
+    uint64_t x = (uint64_t)(uintptr_t)parent->lua_obj_ptr;
+    x = (x ^ (uint64_t)(uintptr_t)metatable) * 0x9e3779b97f4a7c15ULL + (uint64_t)type;
+    x ^= x >> 29;
+    return (const void*)(uintptr_t)(x | 1);
+}
+
+// 创建parent的聚合节点，添加为第一个子节点并记录到GC_NODE表中
+static struct lua_gc_node* new_aggregate(lua_State* dL,
+    struct lua_gc_node* parent, int type, const void* metatable,
+    const char* link)
+{
+    const void* p = aggregate_ptr(parent, type, metatable);
+    struct lua_gc_node* agg = lua_gc_node_new(type, lua_gc_node_typename(type), p);
+    agg->count = 0;
+    agg->refs = 1;
+    agg->metatable = metatable;
+    strncpy(agg->link, link, LUA_GC_NODE_LINK_SIZE - 1);
+    lua_gc_node_add_child(parent, agg);
+    set_gc_node(dL, p, agg);
+    return agg;
+}
+
+// 判断节点是否是可以折叠的数组元素
+static bool is_compactable(const struct lua_gc_node* node)
+{
+    return node->link[0] == '[' && ((node->link[1] >= '0' && node->link[1] <= '9') || node->link[1] == '-')
+        && !lua_gc_node_is_aggregate(node);
+}
+
+// 将*slot指向的节点及其子树折叠到agg中并从兄弟链表中移除，
+// 子树中的对象指向agg，之后对它们的引用计入agg
+static void fold_node(lua_State* dL, struct lua_gc_node* agg,
+    struct lua_gc_node** slot)
+{
+    struct lua_gc_node* node = *slot;
+    *slot = node->next_sibling;
+    node->parent->children--;
+    // metatable通常被所有同类对象共享，移到聚合节点下保留，以免丢失类名
+    struct lua_gc_node** child = &node->first_child;
+    while (*child != NULL) {
+        struct lua_gc_node* mt = *child;
+        if (strcmp(mt->link, "[metatable]") == 0) {
+            *child = mt->next_sibling;
+            mt->next_sibling = NULL;
+            lua_gc_node_add_child(agg, mt);
+        } else {
+            child = &mt->next_sibling;
+        }
+    }
+    struct lua_gc_node* n;
+    for (n = node; n != NULL; n = lua_gc_node_next(node, n)) {
+        // 弱引用的边不拥有被引用的对象
+        if (n->type == LUA_GC_NODE_WEAK_TYPE)
+            continue;
+        agg->size += n->size;
+        set_gc_node(dL, n->lua_obj_ptr, agg);
+    }
+    agg->count++;
+    snprintf(agg->desc, LUA_GC_NODE_DESC_SIZE, "(aggregate: %u)", agg->count);
+    lua_gc_node_free(node);
+}
+
+// 节点遍历结束后，将其折叠到同类型、同metatable的聚合节点中，
+// 聚合节点不存在时，连续compact个同类的数组元素才折叠
+static void compact_node(lua_State* dL, struct traverse_context* ctx,
+    struct lua_gc_node* node)
+{
+    struct lua_gc_node* parent = node->parent;
+    if (parent->lua_obj_ptr == NULL || !is_compactable(node))
+        return;
+    struct lua_gc_node* agg = NULL;
+    lua_rawgetp(dL, GC_NODE, aggregate_ptr(parent, node->type, node->metatable));
+    if (lua_islightuserdata(dL, -1))
+        agg = (struct lua_gc_node*)lua_touserdata(dL, -1);
+    lua_pop(dL, 1);
+    if (agg == NULL) {
+        unsigned int run = 0;
+        struct lua_gc_node* n;
+        for (n = node; n != NULL && run < ctx->compact; n = n->next_sibling) {
+            if (n->type != node->type || n->metatable != node->metatable || !is_compactable(n))
+                break;
+            run++;
+        }
+        if (run < ctx->compact)
+            return;
+        agg = new_aggregate(dL, parent, node->type, node->metatable, "[*]");
+        // 新的聚合节点是第一个子节点，需要折叠的节点紧随其后
+        while (run-- > 0)
+            fold_node(dL, agg, &agg->next_sibling);
+        return;
+    }
+    // 节点的子树已经遍历完毕，此时node一定是父节点的第一个子节点
+    fold_node(dL, agg, &parent->first_child);
+}
+
+// 节点遍历结束后调用，有baseline时丢弃相对baseline没有变化且没有子节点的节点
+static void finish_node(lua_State* dL, struct lua_gc_node* node)
+{
+    struct traverse_context* ctx = get_context(dL);
+    ctx->depth--;
+    // 抽样单元中的对象代表了k个单元中的对象
+    long weight = ctx->unit != NULL ? ctx->sample : 1;
+    if (node->metatable != NULL)
+        count_class(ctx, node, weight);
+    if (ctx->stats_only) {
+        // 只做统计时，节点在统计后立即丢弃
+        ctx->type_counts[node->type] += weight;
+        ctx->type_sizes[node->type] += node->size * weight;
+        if (node->type == LUA_TFUNCTION && node->desc[0] != 0)
+            lua_gc_node_group_add(&ctx->sources, node->desc, weight, node->size * weight);
+        if (ctx->unit != NULL) {
+            ctx->unit_counts[node->type]++;
+            ctx->unit_sizes[node->type] += node->size;
+            if (ctx->unit == node)
+                finish_unit(ctx);
+        }
+        // 只做统计时不记录弱引用的边，子节点都已先于node遍历完并移除
+        node->parent->first_child = node->next_sibling;
+        node->next_sibling = ctx->spare_nodes;
+        ctx->spare_nodes = node;
+        return;
+    } else if (ctx->baseline != NULL) {
+        struct lua_gc_node* base = lua_gc_node_find(ctx->baseline, node->lua_obj_ptr);
+        if (lua_gc_node_mark_incr(node, base) || node->first_child != NULL)
+            return;
+        // 对象仍然需要标识为已访问，但不再对应任何节点
+        set_gc_node(dL, node->lua_obj_ptr, NULL);
+    } else {
+        if (ctx->compact > 0)
+            compact_node(dL, ctx, node);
+        return;
+    }
+    // 节点的子树已经遍历完毕，此时node一定是父节点的第一个子节点
+    node->parent->first_child = node->next_sibling;
+    lua_gc_node_free(node);
+}
+
 static const char* keystring(lua_State* L, int index, char* buffer,
     size_t size)
 {
@@ -146,17 +625,152 @@ static const char* keystring(lua_State* L, int index, char* buffer,
     return buffer;
 }
 
-static bool is_marked(lua_State* dL, const void* p)
+// 多根快照中节点所属的根对象节点，即虚拟根节点的子节点
+static struct lua_gc_node* root_of(struct lua_gc_node* roots,
+    struct lua_gc_node* node)
 {
+    while (node != NULL && node->parent != roots)
+        node = node->parent;
+    return node;
+}
+
+// 记录从parent经link指向node的跨根引用
+static void add_cross_edge(struct traverse_context* ctx,
+    struct lua_gc_node* parent, const char* link, struct lua_gc_node* node)
+{
+    char from[LUA_GC_NODE_LINK_SIZE * 16];
+    char to[LUA_GC_NODE_LINK_SIZE * 16];
+    int len = lua_gc_node_full_link(parent, from, sizeof(from));
+    snprintf(from + len, sizeof(from) - len, ".%s", link);
+    lua_gc_node_full_link(node, to, sizeof(to));
+    struct cross_edge* edge = (struct cross_edge*)malloc(sizeof(*edge));
+    edge->from = strdup(from);
+    edge->to = strdup(to);
+    edge->next = ctx->cross_edges;
+    ctx->cross_edges = edge;
+}
+
+// 对象已访问时返回true，并增加其节点的引用计数
+// 多根快照中对象已属于另一个根对象时，记录跨根引用
+static bool is_marked(lua_State* dL, const void* p, struct lua_gc_node* parent,
+    const char* link)
+{
+    struct traverse_context* ctx = get_context(dL);
+    if (ctx->stats_only)
+        return visited_contains(&ctx->visited, p);
     lua_rawgetp(dL, GC_NODE, p);
     if (lua_isnil(dL, -1)) {
         lua_pop(dL, 1);
         return false;
     }
-    struct lua_gc_node* node = (struct lua_gc_node*)lua_topointer(dL, -1);
-    // 增加引用计数
-    node->refs += 1;
+    // 增加引用计数，已被丢弃的对象没有对应的节点
+    if (lua_islightuserdata(dL, -1)) {
+        struct lua_gc_node* node = (struct lua_gc_node*)lua_touserdata(dL, -1);
+        node->refs += 1;
+        if (ctx->roots != NULL && root_of(ctx->roots, node) != root_of(ctx->roots, parent))
+            add_cross_edge(ctx, parent, link, node);
+    }
+    lua_pop(dL, 1);
+    return true;
+}
+
+#ifdef SNAPSHOT_LUAJIT
+// ffi.sizeof在registry中的key
+static char cdata_sizeof_key;
+
+// 估算栈顶cdata的大小，不弹出cdata
+// L可能是挂起的协程，不能在其中调用函数，所以复制到调用snapshot的线程mL中再调用ffi.sizeof
+static unsigned long cdata_size(lua_State* L, lua_State* mL)
+{
+    unsigned long size = CDATA_HEADER_SIZE;
+    luaL_checkstack(mL, 3, NULL);
+    lua_pushvalue(L, -1);
+    lua_xmove(L, mL, 1);
+    lua_pushlightuserdata(mL, &cdata_sizeof_key);
+    lua_rawget(mL, LUA_REGISTRYINDEX);
+    lua_insert(mL, -2);
+    // 大小未知的类型ffi.sizeof返回nil
+    if (lua_pcall(mL, 1, 1, 0) == 0 && lua_type(mL, -1) == LUA_TNUMBER)
+        size += (unsigned long)lua_tonumber(mL, -1);
+    lua_pop(mL, 1);
+    return size;
+}
+
+// cdata没有可以遍历的子对象，只记录数量和大小
+static void traverse_cdata(lua_State* L, lua_State* dL,
+    struct lua_gc_node* parent, const char* link)
+{
+    const void* p = lua_topointer(L, -1);
+    if (is_marked(dL, p, parent, link)) {
+        lua_pop(L, 1);
+        return;
+    }
+    struct lua_gc_node* curr_node = gen_node(L, dL, parent, link);
+    curr_node->size = cdata_size(L, get_context(dL)->L);
+    lua_pop(L, 1);
+    finish_node(dL, curr_node);
+}
+#endif
+
+// 估算栈顶对象自身的大小，不遍历其子对象
+static unsigned long shallow_size(lua_State* L, lua_State* dL, int type)
+{
+#ifndef SNAPSHOT_LUAJIT
+    // 只有cdata需要从dL中取得被观察的虚拟机
+    (void)dL;
+#endif
+    switch (type) {
+    case LUA_TTABLE: {
+        unsigned long n = 0;
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0) {
+            lua_pop(L, 1);
+            n++;
+        }
+        return TABLE_HEADER_SIZE + n * TABLE_ENTRY_SIZE;
+    }
+    case LUA_TFUNCTION: {
+        lua_Debug ar;
+        lua_pushvalue(L, -1);
+        lua_getinfo(L, ">u", &ar);
+        return CLOSURE_HEADER_SIZE + ar.nups * UPVALUE_SIZE;
+    }
+    case LUA_TUSERDATA:
+        return USERDATA_HEADER_SIZE + lua_rawlen(L, -1);
+#ifdef SNAPSHOT_LUAJIT
+    case LUA_TCDATA:
+        return cdata_size(L, get_context(dL)->L);
+#endif
+    default:
+        return THREAD_SIZE;
+    }
+}
+
+// parent的子节点数量已达到max_children时，将栈顶对象汇总到parent的聚合节点中，
+// 对象被标识为已访问，不再展开。返回false表示没有汇总
+static bool aggregate_child(lua_State* L, lua_State* dL,
+    struct lua_gc_node* parent, const char* link, unsigned int max_children)
+{
+    struct lua_gc_node* agg = NULL;
+    lua_rawgetp(dL, GC_NODE, aggregate_ptr(parent, LUA_GC_NODE_AGGREGATE_TYPE, NULL));
+    if (lua_islightuserdata(dL, -1))
+        agg = (struct lua_gc_node*)lua_touserdata(dL, -1);
     lua_pop(dL, 1);
+    if (agg == NULL) {
+        if (parent->children < max_children)
+            return false;
+        agg = new_aggregate(dL, parent, LUA_GC_NODE_AGGREGATE_TYPE, NULL, "[...]");
+    }
+    const void* p = lua_topointer(L, -1);
+    if (is_marked(dL, p, parent, link))
+        return true;
+    // _G表只在link为"_G"时展开，不能被汇总
+    if (p == get_context(dL)->globals)
+        return false;
+    agg->count++;
+    agg->size += shallow_size(L, dL, lua_type(L, -1));
+    snprintf(agg->desc, LUA_GC_NODE_DESC_SIZE, "(aggregate: %u)", agg->count);
+    set_gc_node(dL, p, NULL);
     return true;
 }
 
@@ -166,9 +780,8 @@ static void traverse_object(lua_State* L, lua_State* dL,
     // 判断该对象是否是一个snapshot对象
     if (lua_getmetatable(L, -1)) {
         luaL_getmetatable(L, SNAPSHOT_METATABLE);
-        lua_equal(L, -1, -2);
         // 如果是，则跳过
-        if (lua_toboolean(L, -1)) {
+        if (lua_rawequal(L, -1, -2)) {
             lua_pop(L, 3);
             return;
         }
@@ -176,6 +789,18 @@ static void traverse_object(lua_State* L, lua_State* dL,
     }
 
     int type = lua_type(L, -1);
+    struct traverse_context* ctx = get_context(dL);
+    if (is_collectable(type)) {
+        // 超过深度限制的对象不展开，也不标识为已访问，以便从更浅的路径访问
+        if (ctx->depth_limit > 0 && ctx->depth >= ctx->depth_limit) {
+            lua_pop(L, 1);
+            return;
+        }
+        if (ctx->max_children > 0 && aggregate_child(L, dL, parent, link, ctx->max_children)) {
+            lua_pop(L, 1);
+            return;
+        }
+    }
     switch (type) {
     case LUA_TTABLE:
         traverse_table(L, dL, parent, link);
@@ -189,12 +814,32 @@ static void traverse_object(lua_State* L, lua_State* dL,
     case LUA_TTHREAD:
         traverse_thread(L, dL, parent, link);
         break;
+#ifdef SNAPSHOT_LUAJIT
+    case LUA_TCDATA:
+        traverse_cdata(L, dL, parent, link);
+        break;
+#endif
     default:
         lua_pop(L, 1);
         break;
     }
 }
 
+// 记录从parent经link指向栈顶对象的弱引用，不弹出该对象
+// 弱引用不拥有被引用的对象，对象不展开，也不标识为已访问，仍然可以从强引用访问到。
+// 边的名称为被引用对象的名称，数量和大小为0，不计入统计和增量/减量
+static void add_weak_edge(lua_State* L, struct lua_gc_node* parent,
+    const char* link)
+{
+    const void* p = lua_topointer(L, -1);
+    struct lua_gc_node* edge = lua_gc_node_new(LUA_GC_NODE_WEAK_TYPE,
+        lua_typename(L, lua_type(L, -1)), p);
+    edge->count = 0;
+    strncpy(edge->desc, "(weak)", LUA_GC_NODE_DESC_SIZE - 1);
+    strncpy(edge->link, link, LUA_GC_NODE_LINK_SIZE - 1);
+    lua_gc_node_add_child(parent, edge);
+}
+
 static void traverse_table(lua_State* L, lua_State* dL,
     struct lua_gc_node* parent, const char* link)
 {
@@ -202,19 +847,33 @@ static void traverse_table(lua_State* L, lua_State* dL,
     if (p == NULL)
         return;
 
-    if (is_marked(dL, p)) {
+    if (is_marked(dL, p, parent, link)) {
         lua_pop(L, 1);
         return;
     }
     // 如果是_G表且link不是_G，则跳过该节点
-    lua_getglobal(L, "_G");
-    if (lua_rawequal(L, -1, -2) && strcmp(link, "_G") != 0) {
-        lua_pop(L, 2);
+    struct traverse_context* ctx = get_context(dL);
+    if (p == ctx->globals && strcmp(link, "_G") != 0) {
+        lua_pop(L, 1);
         return;
     }
-    lua_pop(L, 1);
+
+    // 抽样统计时，不在抽样单元中且足够深的table只展开被抽中的部分，
+    // 容器的元素数量多，抽样误差大，所以总是展开
+    bool new_unit = false;
+    if (ctx->sample > 1 && ctx->unit == NULL && ctx->depth >= ctx->sample_depth
+        && lua_rawlen(L, -1) < SAMPLE_CONTAINER_SIZE) {
+        if (!is_sampled(p, ctx->sample)) {
+            set_gc_node(dL, p, NULL);
+            lua_pop(L, 1);
+            return;
+        }
+        new_unit = true;
+    }
 
     struct lua_gc_node* curr_node = gen_node(L, dL, parent, link);
+    if (new_unit)
+        ctx->unit = curr_node;
 
     bool weakk = false;
     bool weakv = false;
@@ -233,31 +892,132 @@ static void traverse_table(lua_State* L, lua_State* dL,
         }
         lua_pop(L, 1);
 
-        luaL_checkstack(L, LUA_MINSTACK, NULL);
+        note_class(L, ctx, curr_node);
+        check_stack(L, dL, LUA_MINSTACK);
         traverse_object(L, dL, curr_node, "[metatable]");
     }
 
     // 遍历table
     lua_pushnil(L);
     size_t tbl_size = 0;
+    // 作为metatable时的类名，即__name字段
+    const char* class_name = NULL;
+    // 只做统计时不需要格式化link，但仍需要字符串key来识别_G表
+    bool need_link = !ctx->stats_only;
+    // 弱引用的边只在生成完整节点树时记录，其余情况下只计数
+    bool record_weak = need_link && ctx->baseline == NULL;
+    unsigned long weak_size = 0;
     while (lua_next(L, -2) != 0) {
-        // 跳过弱引用的value
+        // 弱引用的value不展开，只记录为弱引用的边
         if (weakv) {
+            if (is_collectable(lua_type(L, -1))) {
+                weak_size++;
+                if (record_weak)
+                    add_weak_edge(L, curr_node, keystring(L, -2, buff, sizeof(buff)));
+            }
             lua_pop(L, 1);
         } else {
-            const char* keystr = keystring(L, -2, buff, sizeof(buff));
+            const char* keystr = need_link ? keystring(L, -2, buff, sizeof(buff))
+                : lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : "";
+            if (keystr[0] == '_' && keystr[1] == '_' && lua_type(L, -1) == LUA_TSTRING
+                && lua_type(L, -2) == LUA_TSTRING && strcmp(keystr, "__name") == 0) {
+                class_name = lua_tostring(L, -1);
+            }
             traverse_object(L, dL, curr_node, keystr);
         }
         if (!weakk) {
             lua_pushvalue(L, -1);
             traverse_object(L, dL, curr_node, "[key]");
+        } else if (is_collectable(lua_type(L, -1))) {
+            weak_size++;
+            if (record_weak)
+                add_weak_edge(L, curr_node, "[key]");
         }
         tbl_size++;
     }
-    // 设置table的描述，主要是大小
-    snprintf(buff, sizeof(buff), "(size: %lu)", tbl_size);
-    strncat(curr_node->desc, buff, LUA_GC_NODE_DESC_SIZE);
+    // 设置table的描述，主要是大小，只做统计时不需要
+    if (need_link) {
+        snprintf(buff, sizeof(buff), "(size: %lu)", tbl_size);
+        strncat(curr_node->desc, buff, LUA_GC_NODE_DESC_SIZE);
+        // 弱引用的数量放在size之后
+        if (weak_size > 0) {
+            snprintf(buff, sizeof(buff), "(weak: %lu)", weak_size);
+            strncat(curr_node->desc, buff, LUA_GC_NODE_DESC_SIZE - strlen(curr_node->desc) - 1);
+        }
+        // 类名放在size之后，以免影响从desc中取出size
+        if (class_name != NULL) {
+            snprintf(buff, sizeof(buff), "(name: %s)", class_name);
+            strncat(curr_node->desc, buff, LUA_GC_NODE_DESC_SIZE - strlen(curr_node->desc) - 1);
+        }
+    }
+    curr_node->size = TABLE_HEADER_SIZE + tbl_size * TABLE_ENTRY_SIZE;
     lua_pop(L, 1);
+    finish_node(dL, curr_node);
+}
+
+#if LUA_VERSION_NUM >= 502 || defined(SNAPSHOT_LUAJIT)
+// 遍历栈顶Lua闭包的第i个upvalue，以lua_upvalueid标识upvalue本身，
+// 共享同一upvalue的闭包指向同一个upvalue节点，其值只遍历一次
+// 返回false表示upvalue不存在
+static bool traverse_upvalue(lua_State* L, lua_State* dL,
+    struct lua_gc_node* parent, int i)
+{
+    const char* name = lua_getupvalue(L, -1, i);
+    if (name == NULL)
+        return false;
+    const char* link = name[0] ? name : "[upvalue]";
+    int type = lua_type(L, -1);
+    // 非GC对象的upvalue不生成节点
+    if (!is_collectable(type)) {
+        lua_pop(L, 1);
+        return true;
+    }
+    // 值超过深度限制时与traverse_object相同，不生成upvalue节点，也不标识为已访问，
+    // 以便共享该upvalue的、更浅的闭包展开其值
+    struct traverse_context* ctx = get_context(dL);
+    if (ctx->depth_limit > 0 && ctx->depth >= ctx->depth_limit) {
+        lua_pop(L, 1);
+        return true;
+    }
+    const void* id = lua_upvalueid(L, -2, i);
+    if (is_marked(dL, id, parent, link)) {
+        lua_pop(L, 1);
+        return true;
+    }
+    // 只做统计时upvalue不计入统计，只需要标识为已访问
+    if (ctx->stats_only) {
+        set_gc_node(dL, id, NULL);
+        traverse_object(L, dL, parent, link);
+        return true;
+    }
+    struct lua_gc_node* cell = lua_gc_node_new(LUA_GC_NODE_UPVALUE_TYPE, "upvalue", id);
+    cell->refs = 1;
+    cell->size = UPVALUE_SIZE;
+    strncpy(cell->link, link, LUA_GC_NODE_LINK_SIZE - 1);
+    lua_gc_node_add_child(parent, cell);
+    set_gc_node(dL, id, cell);
+    // upvalue节点不计入深度，其值与没有upvalue节点时一样位于函数的下一层，
+    // max_depth在各版本中的含义相同。finish_node中的depth--与此处抵消
+    traverse_object(L, dL, cell, "[value]");
+    ctx->depth++;
+    finish_node(dL, cell);
+    return true;
+}
+#endif
+
+// 从缓存中取出或格式化函数的描述，写入node
+static void set_func_desc(struct lua_gc_node* node, const lua_Debug* ar)
+{
+    uintptr_t h = ((uintptr_t)ar->source >> 3) ^ ((uintptr_t)ar->linedefined * 2654435761u);
+    struct func_desc* d = &func_desc_cache[h & (FUNC_DESC_CACHE_SIZE - 1)];
+    if (d->source != ar->source || d->linedefined != ar->linedefined
+        || strcmp(d->short_src, ar->short_src) != 0) {
+        d->source = ar->source;
+        d->linedefined = ar->linedefined;
+        strcpy(d->short_src, ar->short_src);
+        snprintf(d->desc, LUA_GC_NODE_DESC_SIZE, "(func: %s:%d)", ar->short_src, ar->linedefined);
+    }
+    memcpy(node->desc, d->desc, LUA_GC_NODE_DESC_SIZE);
 }
 
 static void traverse_function(lua_State* L, lua_State* dL,
@@ -267,7 +1027,7 @@ static void traverse_function(lua_State* L, lua_State* dL,
     if (p == NULL)
         return;
 
-    if (is_marked(dL, p)) {
+    if (is_marked(dL, p, parent, link)) {
         lua_pop(L, 1);
         return;
     }
@@ -275,23 +1035,34 @@ static void traverse_function(lua_State* L, lua_State* dL,
     struct lua_gc_node* curr_node = gen_node(L, dL, parent, link);
     // 遍历upvalue
     int i;
-    for (i = 1;; i++) {
-        const char* name = lua_getupvalue(L, -1, i);
-        if (name == NULL)
-            break;
-        traverse_object(L, dL, curr_node, name[0] ? name : "[upvalue]");
+#if LUA_VERSION_NUM >= 502 || defined(SNAPSHOT_LUAJIT)
+    // Lua闭包的upvalue可以被多个闭包共享，闭包中只保存指向upvalue的指针
+    if (!lua_iscfunction(L, -1)) {
+        for (i = 1; traverse_upvalue(L, dL, curr_node, i); i++)
+            ;
+        curr_node->size = CLOSURE_HEADER_SIZE + (i - 1) * sizeof(void*);
+    } else
+#endif
+    {
+        for (i = 1;; i++) {
+            const char* name = lua_getupvalue(L, -1, i);
+            if (name == NULL)
+                break;
+            traverse_object(L, dL, curr_node, name[0] ? name : "[upvalue]");
+        }
+        curr_node->size = CLOSURE_HEADER_SIZE + (i - 1) * UPVALUE_SIZE;
     }
+    mark_function_env(L, dL, curr_node);
     if (lua_iscfunction(L, -1)) {
         lua_pop(L, 1);
     } else {
+        // lua_getinfo不在VM中分配内存，描述直接写入节点
         lua_Debug ar;
         lua_getinfo(L, ">S", &ar);
-        snprintf(buff, sizeof(buff), "(func: %s:%d)", ar.short_src, ar.linedefined);
-        lua_pushstring(dL, buff);
-        lua_rawsetp(dL, SOURCE, curr_node);
         // 设置function节点的desc,主要包括定义的源文件名和行数
-        snprintf(curr_node->desc, LUA_GC_NODE_DESC_SIZE, "%s", buff);
+        set_func_desc(curr_node, &ar);
     }
+    finish_node(dL, curr_node);
 }
 
 static void traverse_thread(lua_State* L, lua_State* dL,
@@ -300,50 +1071,77 @@ static void traverse_thread(lua_State* L, lua_State* dL,
     const void* p = lua_topointer(L, -1);
     if (p == NULL)
         return;
-    if (is_marked(dL, p)) {
+    if (is_marked(dL, p, parent, link)) {
         lua_pop(L, 1);
         return;
     }
 
     struct lua_gc_node* curr_node = gen_node(L, dL, parent, link);
 
+    // 正在运行的线程跳过snapshot函数自身所在的层，挂起、正常（resume了其他协程）
+    // 和已结束的协程从第0层开始
     int level = 0;
     lua_State* cL = lua_tothread(L, -1);
     if (cL == L) {
         level = 1;
-    } else { /* TODO 多线程支持 */
     }
+    check_stack(cL, dL, LUA_MINSTACK);
+    bool need_link = !get_context(dL)->stats_only;
 
     lua_Debug ar;
-    luaL_Buffer b;
-    luaL_buffinit(dL, &b);
-    // 遍历函数局部变量
+    // 遍历每一层调用的函数、局部变量和可变参数
     while (lua_getstack(cL, level, &ar)) {
-        lua_getinfo(cL, "Sl", &ar);
-        /*
-snprintf(buff, sizeof(buff), "%s", ar.short_src);
-if (ar.currentline >= 0) {
-char tmp[16];
-sprintf(tmp, ":%d", ar.currentline);
-strncat(buff, tmp, sizeof(buff) - 1);
-}
-*/
-
+        lua_getinfo(cL, "Sf", &ar);
+        // 调用中的函数，其upvalue随之遍历
+        traverse_object(cL, dL, curr_node, "[function]");
+        // link为[局部变量名:源文件]，源文件部分每层只生成一次
+        char suffix[LUA_IDSIZE + 2];
+        size_t suffix_len = 0;
+        if (need_link)
+            suffix_len = (size_t)snprintf(suffix, sizeof(suffix), ":%s]", ar.short_src);
         int i, j;
-        for (j = 1; j > -1; j -= 2) {
+        // 先遍历局部变量(正序号)，再遍历可变参数(负序号)
+        for (j = 1; j >= -1; j -= 2) {
             for (i = j;; i += j) {
                 const char* name = lua_getlocal(cL, &ar, i);
                 if (name == NULL)
                     break;
-                snprintf(buff, sizeof(buff), "[%s:%s]", name, ar.short_src);
+                // 非GC对象不会生成节点，不需要生成link
+                int type = lua_type(cL, -1);
+                if (!is_collectable(type)) {
+                    lua_pop(cL, 1);
+                    continue;
+                }
+                buff[0] = 0;
+                if (need_link) {
+                    size_t len = strlen(name);
+                    if (len + suffix_len + 2 > sizeof(buff))
+                        len = sizeof(buff) - suffix_len - 2;
+                    buff[0] = '[';
+                    memcpy(buff + 1, name, len);
+                    memcpy(buff + 1 + len, suffix, suffix_len + 1);
+                }
                 traverse_object(cL, dL, curr_node, buff);
             }
         }
         ++level;
     }
+    // 未启动的协程只有主函数和参数，出错结束的协程只有错误对象，它们都不在任何一层调用中
+    if (level == 0) {
+        int top = lua_gettop(cL);
+        int i;
+        for (i = 1; i <= top; ++i) {
+            lua_pushvalue(cL, i);
+            if (need_link)
+                snprintf(buff, sizeof(buff), "[stack:%d]", i);
+            traverse_object(cL, dL, curr_node, buff);
+        }
+    }
     snprintf(curr_node->desc, LUA_GC_NODE_DESC_SIZE, "(vars: %d)", level);
+    curr_node->size = THREAD_SIZE;
 
     lua_pop(L, 1);
+    finish_node(dL, curr_node);
 }
 
 static void traverse_userdata(lua_State* L, lua_State* dL,
@@ -353,83 +1151,852 @@ static void traverse_userdata(lua_State* L, lua_State* dL,
     if (p == NULL)
         return;
 
-    if (is_marked(dL, p)) {
+    if (is_marked(dL, p, parent, link)) {
         lua_pop(L, 1);
         return;
     }
 
     struct lua_gc_node* curr_node = gen_node(L, dL, parent, link);
+    curr_node->size = USERDATA_HEADER_SIZE + lua_rawlen(L, -1);
 
     if (lua_getmetatable(L, -1)) {
+        note_class(L, get_context(dL), curr_node);
         traverse_object(L, dL, curr_node, "[metatable]");
     }
 
+#if LUA_VERSION_NUM >= 504
+    // Lua 5.4的userdata可以有多个user value，lua_getuservalue只能取得第一个
+    int n;
+    for (n = 1; lua_getiuservalue(L, -1, n) != LUA_TNONE; n++) {
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+        } else if (n == 1) {
+            traverse_object(L, dL, curr_node, "[userdata]");
+        } else {
+            snprintf(buff, sizeof(buff), "[userdata:%d]", n);
+            traverse_object(L, dL, curr_node, buff);
+        }
+    }
+    // 不存在的user value也压入了nil
+    lua_pop(L, 2);
+    curr_node->size += (n - 1) * USERVALUE_SIZE;
+#else
+    // Lua 5.1中userdata的环境表默认为全局表，与函数的环境表一样不重复记录
     lua_getuservalue(L, -1);
-    if (lua_isnil(L, -1)) {
+    if (lua_isnil(L, -1) || is_global_env(L, -1)) {
         lua_pop(L, 2);
     } else {
         traverse_object(L, dL, curr_node, "[userdata]");
         lua_pop(L, 1);
     }
+#endif
+    finish_node(dL, curr_node);
 }
 
 
-static int lua_gc_node_gc(lua_State* L)
+// 检查第idx个参数是否是snapshot对象，不是则报错
+static struct snapshot_data* check_snapshot(lua_State* L, int idx)
 {
-    struct lua_gc_node* node = *(struct lua_gc_node**)lua_touserdata(L, -1);
-    if (node != NULL)
-        lua_gc_node_free(node);
-    return 0;
+    void* ptr = lua_touserdata(L, idx);
+    if (ptr == NULL || !lua_getmetatable(L, idx)) {
+        luaL_error(L, "Argument %d should be a snapshot.", idx);
+        return NULL;
+    }
+    luaL_getmetatable(L, SNAPSHOT_METATABLE);
+    if (!lua_rawequal(L, -1, -2)) {
+        luaL_error(L, "Argument %d should be a snapshot.", idx);
+        return NULL;
+    }
+    lua_pop(L, 2);
+    return (struct snapshot_data*)ptr;
 }
 
-static int snapshot(lua_State* L)
+// 以root为根节点创建snapshot对象并压栈
+static struct snapshot_data* push_snapshot(lua_State* L,
+    struct lua_gc_node* root)
 {
-    int nargs = lua_gettop(L);
-    if (nargs != 0 && nargs != 2) {
-        luaL_error(L, "Number of arguments should be 0 or 2.");
-        return 0;
+    struct snapshot_data* sd = (struct snapshot_data*)lua_newuserdata(L, sizeof(struct snapshot_data));
+    memset(sd, 0, sizeof(*sd));
+    sd->root = root;
+    luaL_getmetatable(L, SNAPSHOT_METATABLE);
+    lua_setmetatable(L, -2);
+    return sd;
+}
+
+// userdata只有几个指针大小，节点树在native内存中，GC感知不到快照的实际大小，
+// 大量不再使用的快照可能迟迟不被回收。以LUA_GCSTEP将live_before之后新建的节点的大小计入GC的债务，
+// 与分配了同样大小的内存一样推进GC。GC可能执行__gc并出错，必须在快照的各字段都设置好之后、返回之前调用。
+// 宿主停止了GC时不推进；Lua 5.1无法得知GC是否停止，不推进
+static void report_native_size(lua_State* L, long live_before)
+{
+#ifdef LUA_GCISRUNNING
+    long nodes = lua_gc_node_live_count() - live_before;
+    if (nodes <= 0 || !lua_gc(L, LUA_GCISRUNNING, 0))
+        return;
+    size_t kb = (size_t)nodes * sizeof(struct lua_gc_node) / 1024;
+    if (kb > 0)
+        lua_gc(L, LUA_GCSTEP, kb > INT_MAX ? INT_MAX : (int)kb);
+#else
+    (void)L;
+    (void)live_before;
+#endif
+}
+
+// 释放snapshot对象所持有的节点和索引
+// 释放跨根引用链表
+static void free_cross_edges(struct cross_edge* edge)
+{
+    while (edge != NULL) {
+        struct cross_edge* next = edge->next;
+        free(edge->from);
+        free(edge->to);
+        free(edge);
+        edge = next;
     }
+}
+
+// 释放采样对象链表
+static void free_alloc_sites(struct alloc_site* site)
+{
+    while (site != NULL) {
+        struct alloc_site* next = site->next;
+        free(site->stack);
+        free(site);
+        site = next;
+    }
+}
+
+static void free_snapshot(struct snapshot_data* sd)
+{
+    free_alloc_sites(sd->alloc_sites);
+    sd->alloc_sites = NULL;
+    free_cross_edges(sd->cross_edges);
+    sd->cross_edges = NULL;
+    lua_gc_node_group_free(sd->classes);
+    sd->classes = NULL;
+    lua_gc_node_path_free(sd->paths);
+    sd->paths = NULL;
+    lua_gc_node_free(sd->root);
+    sd->root = NULL;
+}
+
+static int lua_gc_node_gc(lua_State* L)
+{
+    free_snapshot((struct snapshot_data*)lua_touserdata(L, -1));
+    return 0;
+}
+
+// 新建对象的类型由lua_Alloc的osize给出(Lua 5.2及以上版本)，取低4位以去掉类型的变体位
+#define ALLOC_TYPE_COUNT 16
+
+// 默认的采样间隔，平均每分配该数量的字节采样一次
+#define ALLOC_SAMPLE_DEFAULT (512 * 1024)
+// 采样时记录的调用栈的最大层数
+#define ALLOC_STACK_DEPTH 16
+
+// 被采样的对象，以指针为key保存在alloc_tracker的哈希表中，对象释放时删除
+struct alloc_sample {
+    const void* ptr; //为NULL时是空位
+    size_t size;
+    int type;
+    char* stack;
+};
+
+// 包装VM的lua_Alloc，统计内存分配
+// 每个VM独立拥有一个，只在VM所在的线程中更新，不需要加锁
+struct alloc_tracker {
+    lua_Alloc allocf; //被包装的分配函数
+    void* ud;
+    long bytes; //VM当前占用的字节数
+    unsigned long allocs; //分配的内存块数量
+    unsigned long frees; //释放的内存块数量
+    unsigned long type_counts[ALLOC_TYPE_COUNT]; //按新建对象的类型统计的分配次数
+    unsigned long type_bytes[ALLOC_TYPE_COUNT]; //按新建对象的类型统计的分配字节数
+    lua_State* mainL; //主线程，采样时从其当前调用栈获取分配位置
+    long sample_interval; //大于0时开启采样，为两次采样之间平均分配的字节数
+    long sample_countdown; //距离下一次采样还需分配的字节数
+    uint64_t rand_state; //生成采样间隔的随机数状态
+    struct alloc_sample* samples; //存活的采样对象，线性探测的开放寻址哈希表
+    unsigned int sample_cap; //哈希表的容量，为2的幂
+    unsigned int sample_count; //存活的采样对象数量
+};
+
+// 采样间隔服从均值为sample_interval的指数分布，即按分配的字节做泊松采样
+// 每个字节被采样的概率相同，大对象被采中的概率与其大小成正比
+static long next_sample_interval(struct alloc_tracker* t)
+{
+    // xorshift64*
+    uint64_t x = t->rand_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    t->rand_state = x;
+    double u = (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+    return (long)(-log(1.0 - u) * t->sample_interval) + 1;
+}
+
+static inline unsigned int sample_slot(const void* p, unsigned int cap)
+{
+    return (unsigned int)(((uint64_t)(uintptr_t)p * 0x9E3779B97F4A7C15ULL) >> 32) & (cap - 1);
+}
+
+static void insert_sample(struct alloc_tracker* t, const struct alloc_sample* s)
+{
+    unsigned int i = sample_slot(s->ptr, t->sample_cap);
+    while (t->samples[i].ptr != NULL)
+        i = (i + 1) & (t->sample_cap - 1);
+    t->samples[i] = *s;
+    t->sample_count++;
+}
+
+// 保持装载因子不超过1/2，失败时返回false
+static bool reserve_samples(struct alloc_tracker* t)
+{
+    if ((t->sample_count + 1) * 2 <= t->sample_cap)
+        return true;
+    unsigned int cap = t->sample_cap > 0 ? t->sample_cap * 2 : 64;
+    struct alloc_sample* old = t->samples;
+    unsigned int old_cap = t->sample_cap;
+    t->samples = (struct alloc_sample*)calloc(cap, sizeof(struct alloc_sample));
+    if (t->samples == NULL) {
+        t->samples = old;
+        return false;
+    }
+    t->sample_cap = cap;
+    t->sample_count = 0;
+    unsigned int i;
+    for (i = 0; i < old_cap; ++i) {
+        if (old[i].ptr != NULL)
+            insert_sample(t, &old[i]);
+    }
+    free(old);
+    return true;
+}
+
+// 对象被释放或移动时删除其采样，后续的元素向前移动以保持探测链连续
+static void drop_sample(struct alloc_tracker* t, const void* p)
+{
+    unsigned int mask = t->sample_cap - 1;
+    unsigned int i = sample_slot(p, t->sample_cap);
+    while (t->samples[i].ptr != p) {
+        if (t->samples[i].ptr == NULL)
+            return;
+        i = (i + 1) & mask;
+    }
+    free(t->samples[i].stack);
+    t->sample_count--;
+    unsigned int j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (t->samples[j].ptr == NULL)
+            break;
+        // j处元素的初始位置k在(i, j]之间时不能移动到i
+        unsigned int k = sample_slot(t->samples[j].ptr, t->sample_cap);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        t->samples[i] = t->samples[j];
+        i = j;
+    }
+    t->samples[i].ptr = NULL;
+    t->samples[i].stack = NULL;
+}
+
+static void free_samples(struct alloc_tracker* t)
+{
+    unsigned int i;
+    for (i = 0; i < t->sample_cap; ++i)
+        free(t->samples[i].stack);
+    free(t->samples);
+    t->samples = NULL;
+    t->sample_cap = 0;
+    t->sample_count = 0;
+}
+
+// 在分配函数中获取主线程当前的调用栈，格式为"source:line;source:line"，从当前函数开始
+// 协程中的分配记录为resume所在的位置
+// lua_getstack和lua_getinfo不分配内存，可以在分配函数中调用
+static char* alloc_stack(lua_State* L)
+{
+#ifdef SNAPSHOT_LUAJIT
+    // LuaJIT执行编译后的代码时栈帧没有同步，不能在分配函数中遍历
+    (void)L;
+    return NULL;
+#else
+    char buf[ALLOC_STACK_DEPTH * 64];
+    size_t len = 0;
+    lua_Debug ar;
+    int level;
+    buf[0] = 0;
+    for (level = 0; level < ALLOC_STACK_DEPTH && lua_getstack(L, level, &ar); ++level) {
+        lua_getinfo(L, "Sl", &ar);
+        int n = snprintf(buf + len, sizeof(buf) - len, level == 0 ? "%s:%d" : ";%s:%d",
+            ar.short_src, ar.currentline);
+        if (n < 0 || (size_t)n >= sizeof(buf) - len)
+            break;
+        len += n;
+    }
+    return len > 0 ? strdup(buf) : NULL;
+#endif
+}
+
+static void take_sample(struct alloc_tracker* t, const void* p, int type, size_t size)
+{
+    // 一次大块分配可能跨越多个采样间隔，只记录一次
+    do {
+        t->sample_countdown += next_sample_interval(t);
+    } while (t->sample_countdown <= 0);
+    if (!reserve_samples(t))
+        return;
+    struct alloc_sample s = { p, size, type, alloc_stack(t->mainL) };
+    insert_sample(t, &s);
+}
+
+static void* tracking_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    struct alloc_tracker* t = (struct alloc_tracker*)ud;
+    void* p = t->allocf(t->ud, ptr, osize, nsize);
+    if (ptr == NULL) {
+        if (p != NULL) {
+#if LUA_VERSION_NUM >= 502
+            // ptr为NULL时osize为新建对象的类型，不是对象的内存为0
+            int type = (int)(osize & (ALLOC_TYPE_COUNT - 1));
+#else
+            int type = 0;
+#endif
+            t->allocs++;
+            t->bytes += nsize;
+            t->type_counts[type]++;
+            t->type_bytes[type] += nsize;
+            if (t->sample_interval > 0 && (t->sample_countdown -= (long)nsize) <= 0)
+                take_sample(t, p, type, nsize);
+        }
+    } else if (nsize == 0) {
+        t->frees++;
+        t->bytes -= osize;
+        if (t->sample_count > 0)
+            drop_sample(t, ptr);
+    } else if (p != NULL) {
+        t->bytes += (long)nsize - (long)osize;
+        if (p != ptr && t->sample_count > 0)
+            drop_sample(t, ptr);
+    }
+    return p;
+}
+
+// 分配统计中的类型名称
+static const char* alloc_type_name(int type)
+{
+    switch (type) {
+    case 0:
+        return "other"; //不是对象的内存，如table的数组和哈希部分、栈、字符串缓冲区
+    case LUA_TSTRING:
+        return "string";
+    case LUA_TTABLE:
+        return "table";
+    case LUA_TFUNCTION:
+        return "function";
+    case LUA_TUSERDATA:
+        return "userdata";
+    case LUA_TTHREAD:
+        return "thread";
+#if LUA_VERSION_NUM >= 504
+    case 9: //LUA_TUPVAL
+        return "upvalue";
+    case 10: //LUA_TPROTO
+        return "proto";
+#else
+    case 9: //LUA_TPROTO
+        return "proto";
+    case 10: //Lua 5.2的LUA_TUPVAL
+        return "upvalue";
+#endif
+    default:
+        return "unknown";
+    }
+}
+
+// 当前VM的分配统计，没有开启时返回NULL
+static struct alloc_tracker* get_alloc_tracker(lua_State* L)
+{
+    void* ud = NULL;
+    if (lua_getallocf(L, &ud) != tracking_alloc)
+        return NULL;
+    return (struct alloc_tracker*)ud;
+}
+
+// 恢复被包装的lua_Alloc，没有开启分配统计时返回false
+static bool stop_alloc_tracking(lua_State* L)
+{
+    struct alloc_tracker* t = get_alloc_tracker(L);
+    if (t == NULL)
+        return false;
+    lua_setallocf(L, t->allocf, t->ud);
+    free_samples(t);
+    free(t);
+    return true;
+}
+
+// 分配统计的哨兵在registry中的key
+// VM关闭时哨兵的__gc在释放对象之前恢复被包装的lua_Alloc，并释放alloc_tracker
+static char alloc_sentinel_key;
+
+static int alloc_sentinel_gc(lua_State* L)
+{
+    stop_alloc_tracking(L);
+    return 0;
+}
+
+// 遍历结束后，在GC_NODE中查找仍然存活的采样对象，记录其节点和分配时的调用栈
+// 只有table和函数分配的地址与lua_topointer一致，其他采样(如userdata、table的数组部分)找不到节点
+static void collect_alloc_sites(lua_State* L, lua_State* dL, struct traverse_context* ctx)
+{
+    struct alloc_tracker* t = get_alloc_tracker(L);
+    // 只做统计时节点已经释放
+    if (t == NULL || t->sample_count == 0 || ctx->stats_only)
+        return;
+    unsigned int i;
+    for (i = 0; i < t->sample_cap; ++i) {
+        const struct alloc_sample* s = &t->samples[i];
+        if (s->ptr == NULL)
+            continue;
+        lua_rawgetp(dL, GC_NODE, s->ptr);
+        struct lua_gc_node* node = (struct lua_gc_node*)lua_touserdata(dL, -1);
+        lua_pop(dL, 1);
+        if (node == NULL)
+            continue;
+        struct alloc_site* site = (struct alloc_site*)malloc(sizeof(struct alloc_site));
+        if (site == NULL)
+            return;
+        site->node = node;
+        site->stack = s->stack != NULL ? strdup(s->stack) : NULL;
+        site->next = ctx->alloc_sites;
+        ctx->alloc_sites = site;
+    }
+}
+
+// 以L中idx处的对象为根进行遍历，返回快照的根节点
+// 创建遍历用的lua_State，并将被排除的对象标识为已访问
+static lua_State* new_traverse_state(lua_State* L, struct traverse_context* ctx)
+{
     int i;
     lua_State* dL = luaL_newstate();
     for (i = 0; i < GC_NODE; ++i) {
         lua_newtable(dL);
     }
+    lua_pushlightuserdata(dL, (void*)ctx);
+    lua_getglobal(L, "_G");
+    ctx->globals = lua_topointer(L, -1);
+    lua_pop(L, 1);
+    ctx->L = L;
+    // 被排除的对象标识为已访问，不会被展开
+    for (i = 0; i < ctx->nexcludes; ++i) {
+        set_gc_node(dL, ctx->excludes[i], NULL);
+    }
+    return dL;
+}
+
+static struct lua_gc_node* capture(lua_State* L, int idx, const char* link,
+    struct traverse_context* ctx)
+{
+    lua_State* dL = new_traverse_state(L, ctx);
     struct lua_gc_node father = {};
-    if (nargs == 0) {
-        lua_pushvalue(L, LUA_REGISTRYINDEX);
-        traverse_object(L, dL, &father, "[REGISTRY]");
+    lua_pushvalue(L, idx);
+    traverse_object(L, dL, &father, link);
+    // 根节点不应指向栈上的father
+    if (father.first_child != NULL)
+        father.first_child->parent = NULL;
+    resolve_classes(dL, ctx);
+    collect_alloc_sites(L, dL, ctx);
+    lua_close(dL);
+    free(ctx->visited.slots);
+    while (ctx->spare_nodes != NULL) {
+        struct lua_gc_node* next = ctx->spare_nodes->next_sibling;
+        lua_gc_node_free(ctx->spare_nodes);
+        ctx->spare_nodes = next;
+    }
+    return father.first_child;
+}
+
+// 虚拟根节点的标识，在多次快照中保持一致
+static const char roots_sentinel;
+
+// 多根快照：idx处为{ {obj1, name1}, {obj2, name2}, ... }，所有根对象共享同一个已访问集合，
+// 被多个根对象引用的对象归属于第一个访问到它的根对象
+static struct lua_gc_node* capture_roots(lua_State* L, int idx,
+    struct traverse_context* ctx)
+{
+    int n = (int)lua_rawlen(L, idx);
+    int i;
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, idx, i);
+        if (!lua_istable(L, -1))
+            luaL_error(L, "Roots[%d] should be a table of {root, name}.", i);
+        lua_rawgeti(L, -1, 2);
+        if (lua_type(L, -1) != LUA_TSTRING)
+            luaL_error(L, "Roots[%d] should have a name.", i);
+        lua_pop(L, 2);
+    }
+    struct lua_gc_node* roots = lua_gc_node_new(LUA_GC_NODE_ROOTS_TYPE, "roots", &roots_sentinel);
+    roots->refs = 1;
+    strncpy(roots->link, "[ROOTS]", LUA_GC_NODE_LINK_SIZE - 1);
+    snprintf(roots->desc, LUA_GC_NODE_DESC_SIZE, "(roots: %d)", n);
+    ctx->roots = roots;
+    lua_State* dL = new_traverse_state(L, ctx);
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, idx, i);
+        lua_rawgeti(L, -1, 2);
+        lua_rawgeti(L, -2, 1);
+        traverse_object(L, dL, roots, lua_tostring(L, -2));
+        lua_pop(L, 2);
+    }
+    // 子节点是倒序添加的，恢复为根对象的顺序
+    struct lua_gc_node* child = roots->first_child;
+    roots->first_child = NULL;
+    while (child != NULL) {
+        struct lua_gc_node* next = child->next_sibling;
+        child->next_sibling = roots->first_child;
+        roots->first_child = child;
+        child = next;
+    }
+    resolve_classes(dL, ctx);
+    collect_alloc_sites(L, dL, ctx);
+    lua_close(dL);
+    return roots;
+}
+
+// 从idx处的根对象出发，按link路径（如"_G.package.loaded"）查找对象并压栈，
+// 路径以根对象的名称开头时忽略该部分，找不到时压入nil
+static void push_by_path(lua_State* L, int idx, const char* name,
+    const char* path)
+{
+    size_t name_len = strlen(name);
+    if (name_len > 0 && strncmp(path, name, name_len) == 0 && path[name_len] == '.')
+        path += name_len + 1;
+    lua_pushvalue(L, idx);
+    while (*path != 0 && lua_istable(L, -1)) {
+        size_t len = strcspn(path, ".");
+        // 与keystring的格式一致，[1]、[true]为非字符串key
+        if (len > 2 && path[0] == '[' && path[len - 1] == ']') {
+            char key[64];
+            snprintf(key, sizeof(key), "%.*s", (int)(len - 2), path + 1);
+            char* end = NULL;
+            double num = strtod(key, &end);
+            if (*end == 0)
+                lua_pushnumber(L, num);
+            else if (strcmp(key, "true") == 0 || strcmp(key, "false") == 0)
+                lua_pushboolean(L, key[0] == 't');
+            else
+                lua_pushlstring(L, path, len);
+        } else {
+            lua_pushlstring(L, path, len);
+        }
+        lua_rawget(L, -2);
+        lua_remove(L, -2);
+        path += len;
+        if (*path == '.')
+            path++;
+    }
+    if (*path != 0) {
         lua_pop(L, 1);
-    } else {
-        const char* link = lua_tostring(L, -1);
-        lua_pushvalue(L, -2);
-        traverse_object(L, dL, &father, link);
+        lua_pushnil(L);
+    }
+}
+
+// 多根快照中按link路径查找对象并压栈，路径必须以某个根对象的名称开头，找不到时压入nil
+static void push_by_roots_path(lua_State* L, int roots, const char* path)
+{
+    int n = (int)lua_rawlen(L, roots);
+    int i;
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, roots, i);
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        const char* name = lua_tostring(L, -1);
+        size_t len = name != NULL ? strlen(name) : 0;
+        if (len > 0 && strncmp(path, name, len) == 0 && (path[len] == '.' || path[len] == 0)) {
+            push_by_path(L, lua_gettop(L) - 1, name, path[len] == 0 ? "" : path);
+            lua_replace(L, -4);
+            lua_pop(L, 2);
+            return;
+        }
+        lua_pop(L, 3);
+    }
+    lua_pushnil(L);
+}
+
+// 解析snapshot()的选项表，excludes保存在选项表之上的userdata中，随栈释放
+// name为NULL时为多根快照，root为根对象数组的位置
+static void parse_options(lua_State* L, int opts, int root, const char* name,
+    struct traverse_context* ctx)
+{
+    // depth_limit为0表示不限制，所以先检查max_depth再加1
+    lua_getfield(L, opts, "max_depth");
+    if (!lua_isnil(L, -1)) {
+        lua_Integer max_depth = luaL_checkinteger(L, -1);
+        if (max_depth < 0)
+            luaL_error(L, "max_depth should not be negative.");
+        ctx->depth_limit = max_depth < INT_MAX ? (int)max_depth + 1 : INT_MAX;
+    }
+    lua_getfield(L, opts, "max_children");
+    if (!lua_isnil(L, -1)) {
+        lua_Integer max_children = luaL_checkinteger(L, -1);
+        if (max_children < 0)
+            luaL_error(L, "max_children should not be negative.");
+        ctx->max_children = (unsigned int)max_children;
+    }
+    // compact为true时使用默认值，为数字时指定最少的同类节点数量
+    lua_getfield(L, opts, "compact");
+    if (lua_isboolean(L, -1))
+        ctx->compact = lua_toboolean(L, -1) ? COMPACT_DEFAULT_RUN : 0;
+    else if (!lua_isnil(L, -1)) {
+        lua_Integer compact = luaL_checkinteger(L, -1);
+        if (compact < 0)
+            luaL_error(L, "compact should not be negative.");
+        ctx->compact = (unsigned int)compact;
+    }
+    lua_pop(L, 3);
+
+    lua_getfield(L, opts, "exclude");
+    if (lua_isnil(L, -1)) {
         lua_pop(L, 1);
+        return;
     }
-    struct lua_gc_node** ptr = (struct lua_gc_node**)lua_newuserdata(L, sizeof(struct lua_gc_node*));
-    *ptr = father.first_child;
-    luaL_getmetatable(L, SNAPSHOT_METATABLE);
-    lua_setmetatable(L, -2);
-    lua_close(dL);
+    luaL_checktype(L, -1, LUA_TTABLE);
+    int exclude = lua_gettop(L);
+    int n = (int)lua_rawlen(L, exclude);
+    ctx->excludes = (const void**)lua_newuserdata(L, sizeof(const void*) * (n + 1));
+    int i;
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, exclude, i);
+        // 字符串为link路径，找不到对应的对象时忽略
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            if (name != NULL)
+                push_by_path(L, root, name, lua_tostring(L, -1));
+            else
+                push_by_roots_path(L, root, lua_tostring(L, -1));
+            lua_remove(L, -2);
+        }
+        const void* p = lua_topointer(L, -1);
+        if (p != NULL)
+            ctx->excludes[ctx->nexcludes++] = p;
+        lua_pop(L, 1);
+    }
+}
+
+static int snapshot(lua_State* L)
+{
+    int nargs = lua_gettop(L);
+    if (nargs > 3) {
+        luaL_error(L, "Number of arguments should be 0, 1, 2 or 3.");
+        return 0;
+    }
+    struct traverse_context ctx = {};
+    struct lua_gc_node* root = NULL;
+    long live = lua_gc_node_live_count();
+    // snapshot(options)和snapshot(root, name, options)，options中可以指定root和name
+    int opts = 0;
+    if (nargs == 1 || nargs == 3) {
+        luaL_checktype(L, nargs, LUA_TTABLE);
+        opts = nargs;
+    }
+    if (nargs == 1) {
+        lua_getfield(L, opts, "roots");
+        if (!lua_isnil(L, -1)) {
+            luaL_checktype(L, -1, LUA_TTABLE);
+            int roots_idx = lua_gettop(L);
+            parse_options(L, opts, roots_idx, NULL, &ctx);
+            root = capture_roots(L, roots_idx, &ctx);
+            struct snapshot_data* sd = push_snapshot(L, root);
+            sd->classes = ctx.classes;
+            sd->cross_edges = ctx.cross_edges;
+            sd->alloc_sites = ctx.alloc_sites;
+            report_native_size(L, live);
+            return 1;
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, opts, "root");
+        lua_getfield(L, opts, "name");
+    } else if (nargs == 0) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+    } else {
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 2);
+    }
+    int root_idx = lua_gettop(L) - 1;
+    bool is_registry = lua_isnil(L, root_idx);
+    if (is_registry) {
+        lua_pushvalue(L, LUA_REGISTRYINDEX);
+        lua_replace(L, root_idx);
+    }
+    const char* name = is_registry ? "[REGISTRY]" : luaL_optstring(L, root_idx + 1, "");
+    if (opts != 0)
+        parse_options(L, opts, root_idx, name, &ctx);
+    root = capture(L, root_idx, name, &ctx);
+    struct snapshot_data* sd = push_snapshot(L, root);
+    sd->classes = ctx.classes;
+    sd->alloc_sites = ctx.alloc_sites;
+    report_native_size(L, live);
     return 1;
 }
 
-static int snapshot_printjson(lua_State* L, bool is_formatted)
+// 对比baseline进行快照，只保留新增的对象和size增加的table，
+// 结果与snapshot.incr(baseline, snapshot.snapshot(...))一致，但不需要创建完整的快照
+static int snapshot_new_since(lua_State* L)
 {
-    if (lua_gettop(L) != 1) {
-        luaL_error(L, "Number of arguments should be 1.");
+    int nargs = lua_gettop(L);
+    if (nargs != 1 && nargs != 3) {
+        luaL_error(L, "Number of arguments should be 1 or 3.");
         return 0;
     }
-    void* ptr = lua_touserdata(L, -1);
-    if (!lua_getmetatable(L, -1)) {
-        luaL_error(L, "Argument is not a valid snapshot.");
+    struct traverse_context ctx = {};
+    ctx.baseline = check_snapshot(L, 1)->root;
+    if (ctx.baseline == NULL) {
+        luaL_error(L, "Argument 1 should not be an empty snapshot.");
         return 0;
     }
-    luaL_getmetatable(L, SNAPSHOT_METATABLE);
-    lua_equal(L, -1, -2);
-    if (!lua_toboolean(L, -1)) {
-        luaL_error(L, "Argument is not a valid snapshot.");
+    struct lua_gc_node* root = NULL;
+    long live = lua_gc_node_live_count();
+    if (nargs == 1)
+        root = capture(L, LUA_REGISTRYINDEX, "[REGISTRY]", &ctx);
+    else
+        root = capture(L, 2, luaL_optstring(L, 3, ""), &ctx);
+    // 遍历时统计的是所有实例，与结果中的节点不一致，需要时再根据节点树统计
+    lua_gc_node_group_free(ctx.classes);
+    push_snapshot(L, root)->alloc_sites = ctx.alloc_sites;
+    report_native_size(L, live);
+    return 1;
+}
+
+// 将分组统计结果以数组的形式压栈，每个元素为{ [keyname] = key, count = n, size = n }
+static void push_groups(lua_State* L, struct lua_gc_node_group* groups,
+    const char* keyname)
+{
+    lua_createtable(L, HASH_COUNT(groups), 0);
+    int i = 1;
+    struct lua_gc_node_group* group = NULL;
+    for (group = groups; group != NULL; group = (struct lua_gc_node_group*)group->hh.next) {
+        lua_createtable(L, 0, 3);
+        lua_pushstring(L, group->key);
+        lua_setfield(L, -2, keyname);
+        lua_pushinteger(L, group->count);
+        lua_setfield(L, -2, "count");
+        lua_pushinteger(L, group->size);
+        lua_setfield(L, -2, "size");
+        lua_rawseti(L, -2, i++);
+    }
+}
+
+// 将抽样统计的标准误差写入栈顶的表
+static void set_errors(lua_State* L, double count_var, double size_var)
+{
+    lua_pushnumber(L, sqrt(count_var));
+    lua_setfield(L, -2, "count_err");
+    lua_pushnumber(L, sqrt(size_var));
+    lua_setfield(L, -2, "size_err");
+}
+
+// 只做统计的遍历结束后，按类型汇总数量和大小，并对分组排序
+static void sum_stats(struct traverse_context* ctx, struct lua_gc_node_group** types,
+    long* count, long* size)
+{
+    int i;
+    for (i = 0; i < NODE_TYPE_COUNT; ++i) {
+        if (ctx->type_counts[i] == 0)
+            continue;
+        lua_gc_node_group_add(types, lua_gc_node_typename(i), ctx->type_counts[i], ctx->type_sizes[i]);
+        *count += ctx->type_counts[i];
+        *size += ctx->type_sizes[i];
+    }
+    lua_gc_node_group_sort(types);
+    lua_gc_node_group_sort(&ctx->sources);
+}
+
+// 只统计对象的数量和大小，不生成节点树和link，比snapshot()更快且几乎不占用额外内存
+// 返回{count, size, types = {...}, classes = {...}, sources = {...}}
+// 第2个参数为{ sample = k, depth = d }时进行抽样统计，深度不小于d的table只展开约1/k，
+// 数量和大小为按权重外推的估计值，并给出count_err、size_err(标准误差)
+static int snapshot_stats(lua_State* L)
+{
+    int nargs = lua_gettop(L);
+    if (nargs > 2) {
+        luaL_error(L, "Number of arguments should be 0, 1 or 2.");
+        return 0;
+    }
+    struct traverse_context ctx = {};
+    ctx.stats_only = true;
+    if (nargs == 2) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "sample");
+        ctx.sample = (int)luaL_optinteger(L, -1, 1);
+        lua_getfield(L, 2, "depth");
+        ctx.sample_depth = (int)luaL_optinteger(L, -1, 3);
+        lua_pop(L, 2);
+        if (ctx.sample < 1)
+            luaL_error(L, "Sample should be a positive integer.");
+        if (ctx.sample_depth < 1)
+            luaL_error(L, "Depth should be a positive integer.");
+    }
+    if (lua_isnoneornil(L, 1)) {
+        capture(L, LUA_REGISTRYINDEX, "[REGISTRY]", &ctx);
+    } else {
+        // _G表只在link为"_G"时展开，根对象是_G表时以"_G"为名称，其他根对象与snapshot(root)一样没有名称
+        lua_getglobal(L, "_G");
+        bool is_globals = lua_rawequal(L, 1, -1);
+        lua_pop(L, 1);
+        capture(L, 1, is_globals ? "_G" : "", &ctx);
+    }
+
+    struct lua_gc_node_group* types = NULL;
+    long count = 0;
+    long size = 0;
+    sum_stats(&ctx, &types, &count, &size);
+    int i;
+
+    lua_createtable(L, 0, 8);
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, size);
+    lua_setfield(L, -2, "size");
+    push_groups(L, types, "type");
+    if (ctx.sample > 1) {
+        // 按类型统计的数组已排序，根据类型名称找到对应的方差
+        int n = (int)HASH_COUNT(types);
+        int j;
+        for (i = 1; i <= n; ++i) {
+            lua_rawgeti(L, -1, i);
+            lua_getfield(L, -1, "type");
+            const char* name = lua_tostring(L, -1);
+            for (j = 0; j < NODE_TYPE_COUNT && strcmp(name, lua_gc_node_typename(j)) != 0; ++j)
+                ;
+            lua_pop(L, 1);
+            set_errors(L, ctx.count_vars[j], ctx.size_vars[j]);
+            lua_pop(L, 1);
+        }
+    }
+    lua_setfield(L, -2, "types");
+    if (ctx.sample > 1) {
+        lua_pushinteger(L, ctx.sample);
+        lua_setfield(L, -2, "sample");
+        set_errors(L, ctx.total_count_var, ctx.total_size_var);
+    }
+    push_groups(L, ctx.classes, "class");
+    lua_setfield(L, -2, "classes");
+    push_groups(L, ctx.sources, "source");
+    lua_setfield(L, -2, "sources");
+    lua_gc_node_group_free(types);
+    lua_gc_node_group_free(ctx.classes);
+    lua_gc_node_group_free(ctx.sources);
+    return 1;
+}
+
+static int snapshot_printjson(lua_State* L, bool is_formatted)
+{
+    if (lua_gettop(L) != 1) {
+        luaL_error(L, "Number of arguments should be 1.");
         return 0;
     }
+    void* ptr = check_snapshot(L, 1);
     struct lua_gc_node* node = *(struct lua_gc_node**)(ptr);
     if (node == NULL)
         return 0;
@@ -457,23 +2024,7 @@ static int snapshot_tojsonfile(lua_State* L, bool is_formatted)
         return 0;
     }
     // 检查是否是snapshot类型
-    void* ptr = lua_touserdata(L, -2);
-    if (ptr != NULL) {
-        if (!lua_getmetatable(L, -2)) {
-            luaL_error(L, "Argument 1 should be a snapshot.");
-            return 0;
-        }
-        luaL_getmetatable(L, SNAPSHOT_METATABLE);
-        lua_equal(L, -1, -2);
-        if (!lua_toboolean(L, -1)) {
-            luaL_error(L, "Argument 1 should be a snapshot.");
-            return 0;
-        }
-        lua_pop(L, 2);
-    } else {
-        luaL_error(L, "Argument 1 should be a snapshot.");
-        return 0;
-    }
+    void* ptr = check_snapshot(L, 1);
     const char* filename = lua_tostring(L, -1);
     if (filename == NULL) {
         luaL_error(L, "Argument 2 should be string.");
@@ -521,23 +2072,7 @@ static int snapshot_tofile(lua_State* L)
         return 0;
     }
     // 检查是否是snapshot类型
-    void* ptr = lua_touserdata(L, -2);
-    if (ptr != NULL) {
-        if (!lua_getmetatable(L, -2)) {
-            luaL_error(L, "Argument 1 should be a snapshot.");
-            return 0;
-        }
-        luaL_getmetatable(L, SNAPSHOT_METATABLE);
-        lua_equal(L, -1, -2);
-        if (!lua_toboolean(L, -1)) {
-            luaL_error(L, "Argument 1 should be a snapshot.");
-            return 0;
-        }
-        lua_pop(L, 2);
-    } else {
-        luaL_error(L, "Argument 1 should be a snapshot.");
-        return 0;
-    }
+    void* ptr = check_snapshot(L, 1);
     const char* filename = lua_tostring(L, -1);
     if (filename == NULL) {
         luaL_error(L, "Argument 2 should be string.");
@@ -565,51 +2100,55 @@ static int snapshot_tofile(lua_State* L)
     return 0;
 }
 
-static int snapshot_print(lua_State* L)
+static int snapshot_tofolded(lua_State* L)
 {
-    if (lua_gettop(L) != 1) {
-        luaL_error(L, "Number of arguments should be 1.");
+    int nargs = lua_gettop(L);
+    if (nargs != 2 && nargs != 3) {
+        luaL_error(L, "Number of arguments should be 2 or 3.");
+        return 0;
+    }
+    struct lua_gc_node* node = check_snapshot(L, 1)->root;
+    const char* filename = lua_tostring(L, 2);
+    if (filename == NULL) {
+        luaL_error(L, "Argument 2 should be string.");
         return 0;
     }
-    void* ptr = lua_touserdata(L, -1);
-    if (!lua_getmetatable(L, -1)) {
-        luaL_error(L, "Argument is not a valid snapshot.");
+    // 权重: "count"(默认)以对象数量计，"size"以内存估算值计
+    const char* weight = nargs == 3 ? lua_tostring(L, 3) : "count";
+    if (weight == NULL || (strcmp(weight, "count") != 0 && strcmp(weight, "size") != 0)) {
+        luaL_error(L, "Argument 3 should be \"count\" or \"size\".");
         return 0;
     }
-    luaL_getmetatable(L, SNAPSHOT_METATABLE);
-    lua_equal(L, -1, -2);
-    if (!lua_toboolean(L, -1)) {
-        luaL_error(L, "Argument is not a valid snapshot.");
+    FILE* f = fopen(filename, "wb+");
+    if (f == NULL) {
+        luaL_error(L, "Failed to open file: %s to write.", filename);
         return 0;
     }
-    struct lua_gc_node* node = *(struct lua_gc_node**)(ptr);
-    const char* str = lua_gc_node_to_str(node);
-    printf("%s", str);
+    lua_gc_node_to_folded(node, f, strcmp(weight, "size") == 0);
+    fclose(f);
     return 0;
 }
 
-static int snapshot_free(lua_State* L)
+static int snapshot_print(lua_State* L)
 {
     if (lua_gettop(L) != 1) {
         luaL_error(L, "Number of arguments should be 1.");
         return 0;
     }
-    void* ptr = lua_touserdata(L, -1);
-    if (!lua_getmetatable(L, -1)) {
-        luaL_error(L, "Argument is not a snapshot.");
-        return 0;
-    }
-    luaL_getmetatable(L, SNAPSHOT_METATABLE);
-    lua_equal(L, -1, -2);
-    bool same = lua_toboolean(L, -1);
-    if (!same) {
-        lua_pop(L, 3);
+    void* ptr = check_snapshot(L, 1);
+    struct lua_gc_node* node = *(struct lua_gc_node**)(ptr);
+    const char* str = lua_gc_node_to_str(node);
+    printf("%s", str);
+    return 0;
+}
+
+static int snapshot_free(lua_State* L)
+{
+    if (lua_gettop(L) != 1) {
+        luaL_error(L, "Number of arguments should be 1.");
         return 0;
     }
-    struct lua_gc_node* node = *(struct lua_gc_node**)ptr;
-    lua_gc_node_free(node);
-    *(struct lua_gc_node**)ptr = NULL;
-    lua_pop(L, 3);
+    free_snapshot(check_snapshot(L, 1));
     return 0;
 }
 
@@ -619,25 +2158,11 @@ static int snapshot_copy(lua_State* L)
         luaL_error(L, "Number of arguments should be 1.");
         return 0;
     }
-    void* ptr = lua_touserdata(L, -1);
-    if (!lua_getmetatable(L, -1)) {
-        luaL_error(L, "Argument is not a snapshot.");
-        return 0;
-    }
-    luaL_getmetatable(L, SNAPSHOT_METATABLE);
-    lua_equal(L, -1, -2);
-    bool same = lua_toboolean(L, -1);
-    if (!same) {
-        luaL_error(L, "Argument is not a snapshot.");
-        lua_pushnil(L);
-        return 1;
-    }
+    void* ptr = check_snapshot(L, 1);
     struct lua_gc_node* node = *(struct lua_gc_node**)ptr;
-    struct lua_gc_node* copy = lua_gc_node_copyall(node);
-    ptr = lua_newuserdata(L, sizeof(copy));
-    *(struct lua_gc_node**)ptr = copy;
-    lua_pushvalue(L, -3);
-    lua_setmetatable(L, -2);
+    long live = lua_gc_node_live_count();
+    push_snapshot(L, lua_gc_node_copyall(node));
+    report_native_size(L, live);
 
     return 1;
 }
@@ -648,31 +2173,1712 @@ static int snapshot_diff(lua_State* L, bool isAdded)
         luaL_error(L, "Number of arguments should be 2.");
         return 0;
     }
-    void* ptr1 = lua_touserdata(L, 1);
-    void* ptr2 = lua_touserdata(L, 2);
-    luaL_getmetatable(L, SNAPSHOT_METATABLE);
-    int i;
-    for (i = 1; i <= 2; ++i) {
-        lua_getmetatable(L, i);
-        lua_equal(L, -1, -2);
-        if (!lua_toboolean(L, -1)) {
-            luaL_error(L, "Argument %d is not a snapshot.", i);
-            return 0;
-        }
-        lua_pop(L, 2);
-    }
+    void* ptr1 = check_snapshot(L, 1);
+    void* ptr2 = check_snapshot(L, 2);
     struct lua_gc_node* node1 = *(struct lua_gc_node**)ptr1;
     struct lua_gc_node* node2 = *(struct lua_gc_node**)ptr2;
     struct lua_gc_node* res = NULL;
+    long live = lua_gc_node_live_count();
     if (isAdded)
         lua_gc_node_diff(node1, node2, &res, NULL);
     else
         lua_gc_node_diff(node1, node2, NULL, &res);
-    void* ptr = lua_newuserdata(L, sizeof(res));
-    *(struct lua_gc_node**)ptr = res;
-    luaL_getmetatable(L, SNAPSHOT_METATABLE);
+    push_snapshot(L, res);
+    report_native_size(L, live);
+
+    return 1;
+}
+
+// 将节点的信息压栈：指针、类型、引用次数、大小、link、父节点指针、描述
+static int push_node(lua_State* L, struct lua_gc_node* node)
+{
+    lua_pushlightuserdata(L, (void*)node->lua_obj_ptr);
+    lua_pushstring(L, lua_gc_node_typename(node->type));
+    lua_pushinteger(L, node->refs);
+    lua_pushinteger(L, node->size);
+    lua_pushstring(L, node->link);
+    if (node->parent != NULL)
+        lua_pushlightuserdata(L, (void*)node->parent->lua_obj_ptr);
+    else
+        lua_pushnil(L);
+    lua_pushstring(L, node->desc);
+    return 7;
+}
+
+// 迭代结束的标记
+static char nodes_iter_end;
+
+// nodes()返回的迭代函数
+// upvalue: 1.snapshot对象 2.根节点 3.当前节点 4.过滤条件
+static int snapshot_nodes_iter(lua_State* L)
+{
+    struct lua_gc_node* root = *(struct lua_gc_node**)lua_touserdata(L, lua_upvalueindex(1));
+    if (root != lua_touserdata(L, lua_upvalueindex(2))) {
+        luaL_error(L, "Snapshot has been freed during iteration.");
+        return 0;
+    }
+    struct lua_gc_node* node = (struct lua_gc_node*)lua_touserdata(L, lua_upvalueindex(3));
+    if (node == (struct lua_gc_node*)&nodes_iter_end)
+        return 0;
+    int filter_type = lua_type(L, lua_upvalueindex(4));
+    int type = filter_type == LUA_TNUMBER ? (int)lua_tointeger(L, lua_upvalueindex(4)) : LUA_TNONE;
+    for (;;) {
+        node = node == NULL ? root : lua_gc_node_next(root, node);
+        if (node == NULL) {
+            lua_pushlightuserdata(L, (void*)&nodes_iter_end);
+            lua_replace(L, lua_upvalueindex(3));
+            return 0;
+        }
+        if (filter_type == LUA_TNUMBER && node->type != type)
+            continue;
+        if (filter_type == LUA_TFUNCTION) {
+            lua_pushvalue(L, lua_upvalueindex(4));
+            lua_call(L, push_node(L, node), 1);
+            int keep = lua_toboolean(L, -1);
+            lua_pop(L, 1);
+            if (!keep)
+                continue;
+        }
+        break;
+    }
+    lua_pushlightuserdata(L, (void*)node);
+    lua_replace(L, lua_upvalueindex(3));
+    return push_node(L, node);
+}
+
+// 逐个遍历snapshot中的节点，filter可以是类型名称或过滤函数
+static int snapshot_nodes(lua_State* L)
+{
+    int nargs = lua_gettop(L);
+    if (nargs != 1 && nargs != 2) {
+        luaL_error(L, "Number of arguments should be 1 or 2.");
+        return 0;
+    }
+    struct lua_gc_node* root = check_snapshot(L, 1)->root;
+    lua_pushvalue(L, 1);
+    lua_pushlightuserdata(L, (void*)root);
+    lua_pushlightuserdata(L, NULL);
+    if (nargs == 1 || lua_isnil(L, 2)) {
+        lua_pushnil(L);
+    } else if (lua_type(L, 2) == LUA_TSTRING) {
+        // 将类型名称转换为类型编号，避免每个节点都进行字符串比较
+        const char* typestr = lua_tostring(L, 2);
+        int type;
+        for (type = LUA_TNIL; type <= LUA_GC_NODE_ROOTS_TYPE; ++type) {
+            if (strcmp(typestr, lua_gc_node_typename(type)) == 0)
+                break;
+        }
+        if (type > LUA_GC_NODE_ROOTS_TYPE) {
+            luaL_error(L, "Unknown type name: %s.", typestr);
+            return 0;
+        }
+        lua_pushinteger(L, type);
+    } else if (lua_isfunction(L, 2)) {
+        lua_pushvalue(L, 2);
+    } else {
+        luaL_error(L, "Argument 2 should be a type name or a function.");
+        return 0;
+    }
+    lua_pushcclosure(L, snapshot_nodes_iter, 4);
+    return 1;
+}
+
+// 根据lua对象的指针查找节点
+// ptr可以是lightuserdata、GC对象本身，或形如"table: 0x55c3e5e1a2b0"的字符串
+static int snapshot_find(lua_State* L)
+{
+    if (lua_gettop(L) != 2) {
+        luaL_error(L, "Number of arguments should be 2.");
+        return 0;
+    }
+    struct snapshot_data* sd = check_snapshot(L, 1);
+    const void* p = NULL;
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        const char* str = strstr(lua_tostring(L, 2), "0x");
+        void* scan = NULL;
+        if (str == NULL || sscanf(str, "%p", &scan) != 1) {
+            luaL_error(L, "Argument 2 is not a valid pointer string.");
+            return 0;
+        }
+        p = scan;
+    } else {
+        p = lua_topointer(L, 2);
+    }
+    struct lua_gc_node* node = lua_gc_node_find(sd->root, p);
+    if (node == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    return push_node(L, node);
+}
+
+// 根据link路径查找节点，如"_G.player.camps"
+static int snapshot_find_path(lua_State* L)
+{
+    if (lua_gettop(L) != 2) {
+        luaL_error(L, "Number of arguments should be 2.");
+        return 0;
+    }
+    struct snapshot_data* sd = check_snapshot(L, 1);
+    const char* path = lua_tostring(L, 2);
+    if (path == NULL) {
+        luaL_error(L, "Argument 2 should be string.");
+        return 0;
+    }
+    if (sd->paths == NULL)
+        sd->paths = lua_gc_node_path_index(sd->root);
+    struct lua_gc_node* node = lua_gc_node_find_path(sd->paths, path);
+    if (node == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    return push_node(L, node);
+}
+
+// 三快照(或N快照)泄漏检查：在s2中新增，且在s3...sn中都仍然存活的对象
+// 返回存活对象组成的snapshot对象，以及按所在容器的link路径排序的统计数组
+static int snapshot_survivors(lua_State* L)
+{
+    int nargs = lua_gettop(L);
+    if (nargs < 3) {
+        luaL_error(L, "Number of arguments should be at least 3.");
+        return 0;
+    }
+    struct lua_gc_node** nodes = (struct lua_gc_node**)lua_newuserdata(L, sizeof(struct lua_gc_node*) * nargs);
+    int i;
+    for (i = 0; i < nargs; ++i) {
+        nodes[i] = check_snapshot(L, i + 1)->root;
+    }
+    struct lua_gc_node_group* ranking = NULL;
+    long live = lua_gc_node_live_count();
+    struct lua_gc_node* res = lua_gc_node_survivors(nodes, nargs, &ranking);
+    push_snapshot(L, res);
+    push_groups(L, ranking, "path");
+    lua_gc_node_group_free(ranking);
+    report_native_size(L, live);
+    return 2;
+}
+
+// 分组方式的名称，顺序与enum lua_gc_node_group_by一致
+static const char* const group_by_names[] = { "type", "source", "class", "path", NULL };
+
+// 求s1到s2的差别的分组统计，不生成增量/减量snapshot
+// group_by: "type"(默认)、"source"、"class"、"path"，depth为按link路径分组时的前缀层数
+static int snapshot_diff_summary(lua_State* L)
+{
+    int nargs = lua_gettop(L);
+    if (nargs < 2 || nargs > 4) {
+        luaL_error(L, "Number of arguments should be 2, 3 or 4.");
+        return 0;
+    }
+    struct lua_gc_node* node1 = check_snapshot(L, 1)->root;
+    struct lua_gc_node* node2 = check_snapshot(L, 2)->root;
+    int group_by = luaL_checkoption(L, 3, "type", group_by_names);
+    int depth = (int)luaL_optinteger(L, 4, 2);
+    struct lua_gc_node_group* groups = NULL;
+    lua_gc_node_diff_summary(node1, node2, group_by, depth, &groups);
+    push_groups(L, groups, "key");
+    lua_gc_node_group_free(groups);
+    return 1;
+}
+
+// 按metatable统计实例的数量和大小，以metatable的__name或link路径作为类名
+static int snapshot_class_histogram(lua_State* L)
+{
+    if (lua_gettop(L) != 1) {
+        luaL_error(L, "Number of arguments should be 1.");
+        return 0;
+    }
+    struct snapshot_data* sd = check_snapshot(L, 1);
+    // 通过copy()、incr()等得到的snapshot在第一次使用时根据节点树统计
+    if (sd->classes == NULL && sd->root != NULL) {
+        char name[LUA_GC_NODE_DESC_SIZE + 256];
+        struct lua_gc_node* node;
+        for (node = sd->root; node != NULL; node = lua_gc_node_next(sd->root, node)) {
+            if (lua_gc_node_class_name(sd->root, node, name, sizeof(name)) != NULL)
+                lua_gc_node_group_add(&sd->classes, name, node->count, node->size);
+        }
+        lua_gc_node_group_sort(&sd->classes);
+    }
+    push_groups(L, sd->classes, "class");
+    return 1;
+}
+
+// 返回多根快照中跨越根对象的引用数组，每个元素为{ from = 引用方的link路径, to = 被引用对象的link路径 }
+static int snapshot_cross_edges(lua_State* L)
+{
+    if (lua_gettop(L) != 1) {
+        luaL_error(L, "Number of arguments should be 1.");
+        return 0;
+    }
+    struct snapshot_data* sd = check_snapshot(L, 1);
+    lua_newtable(L);
+    int i = 0;
+    struct cross_edge* edge;
+    // 链表是倒序的，按遍历的顺序输出
+    for (edge = sd->cross_edges; edge != NULL; edge = edge->next)
+        i++;
+    for (edge = sd->cross_edges; edge != NULL; edge = edge->next) {
+        lua_createtable(L, 0, 2);
+        lua_pushstring(L, edge->from);
+        lua_setfield(L, -2, "from");
+        lua_pushstring(L, edge->to);
+        lua_setfield(L, -2, "to");
+        lua_rawseti(L, -2, i--);
+    }
+    return 1;
+}
+
+// 解析track_alloc的选项，sample为true时使用默认的采样间隔，为数字时指定平均采样间隔(字节)
+static void parse_alloc_options(lua_State* L, int opts, struct alloc_tracker* t)
+{
+    lua_getfield(L, opts, "sample");
+    long interval = 0;
+    if (lua_isboolean(L, -1))
+        interval = lua_toboolean(L, -1) ? ALLOC_SAMPLE_DEFAULT : 0;
+    else if (!lua_isnil(L, -1))
+        interval = (long)luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    if (interval < 0)
+        luaL_error(L, "Sample should not be negative.");
+    // 关闭采样后已有的采样仍然在对象释放时删除
+    t->sample_interval = interval;
+    if (interval > 0)
+        t->sample_countdown = next_sample_interval(t);
+}
+
+// track_alloc(true[, options])开启分配统计，track_alloc(false)关闭，返回之前是否已开启
+static int snapshot_track_alloc(lua_State* L)
+{
+    int nargs = lua_gettop(L);
+    if (nargs != 1 && nargs != 2) {
+        luaL_error(L, "Number of arguments should be 1 or 2.");
+        return 0;
+    }
+    luaL_checktype(L, 1, LUA_TBOOLEAN);
+    if (nargs == 2)
+        luaL_checktype(L, 2, LUA_TTABLE);
+    bool tracking = get_alloc_tracker(L) != NULL;
+    if (lua_toboolean(L, 1) && !tracking) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &alloc_sentinel_key);
+        if (lua_isnil(L, -1)) {
+            lua_newuserdata(L, 1);
+            lua_createtable(L, 0, 1);
+            lua_pushcfunction(L, alloc_sentinel_gc);
+            lua_setfield(L, -2, "__gc");
+            lua_setmetatable(L, -2);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, &alloc_sentinel_key);
+        }
+        lua_pop(L, 1);
+        struct alloc_tracker* t = (struct alloc_tracker*)calloc(1, sizeof(*t));
+        if (t == NULL) {
+            luaL_error(L, "Out of memory.");
+            return 0;
+        }
+        t->allocf = lua_getallocf(L, &t->ud);
+        // 从VM当前占用的内存开始计数
+        t->bytes = (long)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+#if LUA_VERSION_NUM >= 502
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#else
+        lua_getfield(L, LUA_REGISTRYINDEX, "mainthread");
+#endif
+        t->mainL = lua_isthread(L, -1) ? lua_tothread(L, -1) : L;
+        lua_pop(L, 1);
+        t->rand_state = (uint64_t)(uintptr_t)t * 0x9E3779B97F4A7C15ULL | 1;
+        lua_setallocf(L, tracking_alloc, t);
+    }
+    if (lua_toboolean(L, 1) && nargs == 2) {
+        parse_alloc_options(L, 2, get_alloc_tracker(L));
+    } else if (!lua_toboolean(L, 1) && tracking) {
+        stop_alloc_tracking(L);
+    }
+    lua_pushboolean(L, tracking);
+    return 1;
+}
+
+// 返回分配统计，没有开启时返回nil
+static int snapshot_alloc_stats(lua_State* L)
+{
+    if (lua_gettop(L) != 0) {
+        luaL_error(L, "Number of arguments should be 0.");
+        return 0;
+    }
+    struct alloc_tracker* t = get_alloc_tracker(L);
+    if (t == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    // 先复制计数，生成返回值时的分配不计入本次的结果
+    struct alloc_tracker counters = *t;
+    struct lua_gc_node_group* types = NULL;
+    int i;
+    for (i = 0; i < ALLOC_TYPE_COUNT; ++i) {
+        if (counters.type_counts[i] > 0)
+            lua_gc_node_group_add(&types, alloc_type_name(i), counters.type_counts[i], counters.type_bytes[i]);
+    }
+    lua_gc_node_group_sort(&types);
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, counters.bytes);
+    lua_setfield(L, -2, "bytes");
+    // 开启前分配的内存块在开启后释放时也会计入frees，所以count可能为负数
+    lua_pushinteger(L, (lua_Integer)counters.allocs - (lua_Integer)counters.frees);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, counters.allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_pushinteger(L, counters.frees);
+    lua_setfield(L, -2, "frees");
+    if (counters.sample_interval > 0 || counters.sample_count > 0) {
+        lua_pushinteger(L, counters.sample_interval);
+        lua_setfield(L, -2, "sample");
+        lua_pushinteger(L, counters.sample_count);
+        lua_setfield(L, -2, "samples");
+    }
+    push_groups(L, types, "type");
+    lua_setfield(L, -2, "types");
+    lua_gc_node_group_free(types);
+    return 1;
+}
+
+// 返回存活的采样对象数组，每个元素为{ type = 类型, size = 分配时的大小, stack = 分配时的调用栈 }
+// 没有开启分配统计时返回nil
+static int snapshot_alloc_samples(lua_State* L)
+{
+    if (lua_gettop(L) != 0) {
+        luaL_error(L, "Number of arguments should be 0.");
+        return 0;
+    }
+    struct alloc_tracker* t = get_alloc_tracker(L);
+    if (t == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    // 生成返回值时的分配和释放会修改哈希表，先复制一份
+    unsigned int n = t->sample_count;
+    struct alloc_sample* samples = (struct alloc_sample*)malloc(sizeof(struct alloc_sample) * (n + 1));
+    if (samples == NULL) {
+        luaL_error(L, "Out of memory.");
+        return 0;
+    }
+    unsigned int i, j = 0;
+    for (i = 0; i < t->sample_cap && j < n; ++i) {
+        if (t->samples[i].ptr == NULL)
+            continue;
+        samples[j] = t->samples[i];
+        samples[j].stack = t->samples[i].stack != NULL ? strdup(t->samples[i].stack) : NULL;
+        j++;
+    }
+    lua_createtable(L, (int)n, 0);
+    for (i = 0; i < n; ++i) {
+        lua_createtable(L, 0, 3);
+        lua_pushstring(L, alloc_type_name(samples[i].type));
+        lua_setfield(L, -2, "type");
+        lua_pushinteger(L, (lua_Integer)samples[i].size);
+        lua_setfield(L, -2, "size");
+        if (samples[i].stack != NULL) {
+            lua_pushstring(L, samples[i].stack);
+            lua_setfield(L, -2, "stack");
+        }
+        lua_rawseti(L, -2, i + 1);
+        free(samples[i].stack);
+    }
+    free(samples);
+    return 1;
+}
+
+// 返回快照中仍然存活的采样对象数组，
+// 每个元素为{ link = 对象的link路径, type = 节点类型, size = 节点大小, stack = 分配时的调用栈 }
+static int snapshot_alloc_sites(lua_State* L)
+{
+    if (lua_gettop(L) != 1) {
+        luaL_error(L, "Number of arguments should be 1.");
+        return 0;
+    }
+    struct snapshot_data* sd = check_snapshot(L, 1);
+    lua_newtable(L);
+    int i = 0;
+    struct alloc_site* site;
+    char link[LUA_GC_NODE_LINK_SIZE * 16];
+    for (site = sd->alloc_sites; site != NULL; site = site->next) {
+        lua_createtable(L, 0, 4);
+        lua_gc_node_full_link(site->node, link, sizeof(link));
+        lua_pushstring(L, link);
+        lua_setfield(L, -2, "link");
+        lua_pushstring(L, lua_gc_node_typename(site->node->type));
+        lua_setfield(L, -2, "type");
+        lua_pushinteger(L, site->node->size);
+        lua_setfield(L, -2, "size");
+        if (site->stack != NULL) {
+            lua_pushstring(L, site->stack);
+            lua_setfield(L, -2, "stack");
+        }
+        lua_rawseti(L, -2, ++i);
+    }
+    return 1;
+}
+
+// 在安全点写入快照：内存水位触发(watch)和信号触发(on_signal)
+// 默认每执行该数量的指令检查一次
+#define SAFEPOINT_CHECK_DEFAULT 10000
+#define DUMP_KEEP_DEFAULT 3
+#define DUMP_PATH_SIZE 512
+
+// 写入快照的文件环
+struct dump_ring {
+    int check; //大于0时设置count hook，为检查间隔的指令数，必须是第一个成员
+    int keep; //文件环中保留的文件数量
+    int next; //下一个写入的文件在环中的序号
+    bool full; //写入压缩后的完整快照，否则只写入统计结果
+    char path[DUMP_PATH_SIZE]; //文件名前缀，实际写入"path.1"到"path.keep"
+};
+
+struct memory_watch {
+    struct dump_ring ring; //必须是第一个成员
+    long threshold_kb; //内存超过该值(KB)时写入快照
+    double cooldown; //两次写入之间至少间隔的秒数
+    time_t last; //上次写入的时间，还没有写入过时为0
+    bool active; //停止或被替换后为false
+};
+
+// memory_watch(userdata)在registry中的key
+static char watch_key;
+// 开启了watch的VM数量，为0时安全点中不做检查
+static int watchers = 0;
+
+// 停止检查，可以重复调用
+static void release_watch(struct memory_watch* w)
+{
+    if (w->active) {
+        w->active = false;
+        watchers--;
+    }
+}
+
+static int memory_watch_gc(lua_State* L)
+{
+    release_watch((struct memory_watch*)lua_touserdata(L, 1));
+    return 0;
+}
+
+// 信号触发时写入的signal_dump(userdata)在registry中的key
+static char signal_key;
+
+// 收到信号的次数，由信号处理函数增加。信号处理函数是整个进程共享的，
+// 每个开启了on_signal的VM记录自己处理过的次数，各自在安全点写入快照
+static volatile sig_atomic_t signal_count = 0;
+// 所有开启了on_signal的VM都已处理过的signal_count，与signal_count相同时安全点中只比较这两个值，不查找registry
+static volatile sig_atomic_t signal_done = 0;
+
+struct signal_dump {
+    struct dump_ring ring; //必须是第一个成员
+    sig_atomic_t seen; //已处理的signal_count
+    bool active; //停止或被替换后为false
+};
+
+#ifdef SIGUSR2
+// 以下由sigusr2_lock保护：开启了on_signal的VM数量，第一个开启时安装信号处理函数，最后一个停止时恢复原来的；
+// 正在确认的signal_count，以及已经处理过它的VM数量
+static int sigusr2_lock = 0;
+static int sigusr2_users = 0;
+static sig_atomic_t signal_acked = 0;
+static int signal_acks = 0;
+static struct sigaction old_sigusr2;
+
+static void on_sigusr2(int sig)
+{
+    (void)sig;
+    signal_count++;
+}
+
+static void lock_sigusr2(void)
+{
+    while (__atomic_exchange_n(&sigusr2_lock, 1, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static void unlock_sigusr2(void)
+{
+    __atomic_store_n(&sigusr2_lock, 0, __ATOMIC_RELEASE);
+}
+
+// d已处理到d->seen，所有VM都处理过时更新signal_done，需要持有sigusr2_lock
+static void ack_signal(const struct signal_dump* d)
+{
+    // 其他VM已经在确认更新的信号，d之后还会处理它
+    if (d->seen < signal_acked)
+        return;
+    if (d->seen != signal_acked) {
+        signal_acked = d->seen;
+        signal_acks = 0;
+    }
+    if (++signal_acks >= sigusr2_users)
+        signal_done = signal_acked;
+}
+
+// d停止或被替换时撤销其确认，需要持有sigusr2_lock
+static void unack_signal(const struct signal_dump* d)
+{
+    if (d->seen == signal_acked)
+        signal_acks--;
+}
+
+// 开启d，old不为NULL时d替换old，沿用已安装的信号处理函数。开启之前收到的信号不触发
+static bool acquire_signal_dump(struct signal_dump* d, struct signal_dump* old)
+{
+    bool ok = true;
+    lock_sigusr2();
+    if (old != NULL) {
+        unack_signal(old);
+        old->active = false;
+    } else {
+        if (sigusr2_users == 0) {
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = on_sigusr2;
+            sigemptyset(&sa.sa_mask);
+            sa.sa_flags = SA_RESTART;
+            ok = sigaction(SIGUSR2, &sa, &old_sigusr2) == 0;
+        }
+        if (ok)
+            sigusr2_users++;
+    }
+    if (ok) {
+        d->active = true;
+        d->seen = signal_count;
+        ack_signal(d);
+    }
+    unlock_sigusr2();
+    return ok;
+}
+
+// 停止并释放对信号处理函数的引用，可以重复调用
+static void release_signal_dump(struct signal_dump* d)
+{
+    if (!d->active)
+        return;
+    d->active = false;
+    lock_sigusr2();
+    unack_signal(d);
+    if (--sigusr2_users == 0) {
+        sigaction(SIGUSR2, &old_sigusr2, NULL);
+        signal_done = signal_count;
+    } else if (signal_acks >= sigusr2_users) {
+        signal_done = signal_acked;
+    }
+    unlock_sigusr2();
+}
+
+static int signal_dump_gc(lua_State* L)
+{
+    release_signal_dump((struct signal_dump*)lua_touserdata(L, 1));
+    return 0;
+}
+#endif
+
+static void groups_to_json(cJSON* object, const char* name, struct lua_gc_node_group* groups,
+    const char* keyname)
+{
+    cJSON* array = cJSON_AddArrayToObject(object, name);
+    struct lua_gc_node_group* group = NULL;
+    for (group = groups; group != NULL; group = (struct lua_gc_node_group*)group->hh.next) {
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, keyname, group->key);
+        cJSON_AddNumberToObject(item, "count", group->count);
+        cJSON_AddNumberToObject(item, "size", group->size);
+        cJSON_AddItemToArray(array, item);
+    }
+}
+
+// 遍历registry，返回统计结果或压缩后的完整快照的JSON字符串，需要用cJSON_free释放
+static char* dump_string(lua_State* L, bool full)
+{
+    long kb = (long)lua_gc(L, LUA_GCCOUNT, 0);
+    char* str = NULL;
+    struct traverse_context ctx = {};
+    if (full) {
+        ctx.compact = COMPACT_DEFAULT_RUN;
+        struct snapshot_data sd = {};
+        sd.root = capture(L, LUA_REGISTRYINDEX, "[REGISTRY]", &ctx);
+        sd.classes = ctx.classes;
+        sd.alloc_sites = ctx.alloc_sites;
+        str = lua_gc_node_to_jsonstr(sd.root);
+        free_snapshot(&sd);
+    } else {
+        ctx.stats_only = true;
+        capture(L, LUA_REGISTRYINDEX, "[REGISTRY]", &ctx);
+        struct lua_gc_node_group* types = NULL;
+        long count = 0;
+        long size = 0;
+        sum_stats(&ctx, &types, &count, &size);
+        cJSON* object = cJSON_CreateObject();
+        cJSON_AddNumberToObject(object, "memory_kb", kb);
+        cJSON_AddNumberToObject(object, "count", count);
+        cJSON_AddNumberToObject(object, "size", size);
+        groups_to_json(object, "types", types, "type");
+        groups_to_json(object, "classes", ctx.classes, "class");
+        groups_to_json(object, "sources", ctx.sources, "source");
+        str = cJSON_PrintUnformatted(object);
+        cJSON_Delete(object);
+        lua_gc_node_group_free(types);
+        lua_gc_node_group_free(ctx.classes);
+        lua_gc_node_group_free(ctx.sources);
+    }
+    return str;
+}
+
+// 遍历registry并写入环中的下一个文件，出错时由lua_pcall捕获
+static int dump_to_ring(lua_State* L)
+{
+    struct dump_ring* ring = (struct dump_ring*)lua_touserdata(L, 1);
+    char filename[DUMP_PATH_SIZE + 16];
+    snprintf(filename, sizeof(filename), "%s.%d", ring->path, ring->next + 1);
+    ring->next = (ring->next + 1) % ring->keep;
+    char* str = dump_string(L, ring->full);
+    if (str == NULL)
+        return luaL_error(L, "Out of memory.");
+    FILE* f = fopen(filename, "wb+");
+    if (f == NULL) {
+        cJSON_free(str);
+        return luaL_error(L, "Failed to open file: %s to write.", filename);
+    }
+    fputs(str, f);
+    fclose(f);
+    cJSON_free(str);
+    return 0;
+}
+
+// 写入快照，失败时忽略，不影响正在执行的代码
+static bool pcall_dump(lua_State* L, struct dump_ring* ring)
+{
+    lua_pushcfunction(L, dump_to_ring);
+    lua_pushlightuserdata(L, ring);
+    if (lua_pcall(L, 1, 0, 0) != 0) {
+        lua_pop(L, 1);
+        return false;
+    }
+    return true;
+}
+
+// 解析写入快照的选项：path必填; keep(默认3), mode("stats"或"full"), check(检查间隔的指令数)
+static void parse_dump_ring(lua_State* L, int opts, struct dump_ring* ring)
+{
+    lua_getfield(L, opts, "keep");
+    int keep = (int)luaL_optinteger(L, -1, DUMP_KEEP_DEFAULT);
+    lua_getfield(L, opts, "check");
+    int check = (int)luaL_optinteger(L, -1, SAFEPOINT_CHECK_DEFAULT);
+    lua_getfield(L, opts, "mode");
+    const char* mode = luaL_optstring(L, -1, "stats");
+    lua_getfield(L, opts, "path");
+    const char* path = luaL_checkstring(L, -1);
+    if (keep < 1)
+        luaL_error(L, "Keep should be a positive integer.");
+    if (check < 0)
+        luaL_error(L, "Check should not be negative.");
+    if (strcmp(mode, "stats") != 0 && strcmp(mode, "full") != 0)
+        luaL_error(L, "Mode should be \"stats\" or \"full\".");
+    if (strlen(path) >= DUMP_PATH_SIZE)
+        luaL_error(L, "Path is too long.");
+    ring->keep = keep;
+    ring->check = check;
+    ring->full = strcmp(mode, "full") == 0;
+    strcpy(ring->path, path);
+    lua_pop(L, 4);
+}
+
+// 收到信号后的第一个安全点写入快照，本VM没有开启on_signal或已经处理过时返回false
+static bool handle_signal(lua_State* L)
+{
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &signal_key);
+    struct signal_dump* d = (struct signal_dump*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    sig_atomic_t count = signal_count;
+    if (d == NULL || d->seen == count)
+        return false;
+    d->seen = count;
+#ifdef SIGUSR2
+    lock_sigusr2();
+    ack_signal(d);
+    unlock_sigusr2();
+#endif
+    return pcall_dump(L, &d->ring);
+}
+
+// Unix域套接字的控制通道：监听线程接收命令并放入队列，在安全点中由VM所在的线程执行并返回结果
+// 整个进程只有一个控制通道，属于调用listen()的VM
+#ifdef SNAPSHOT_CONTROL
+#define CONTROL_LINE_SIZE 1024
+// 读取命令行的超时时间(秒)，慢速的客户端最多占用监听线程这么久
+#define CONTROL_RECV_TIMEOUT 2
+// 写回结果的超时时间(秒)，客户端不读取时VM所在的线程最多阻塞这么久
+#define CONTROL_SEND_TIMEOUT 2
+// snapshot命令最多保存的快照数量，超过时释放最早保存的
+#define CONTROL_SNAPSHOTS_MAX 4
+
+struct control_request {
+    int fd; //客户端连接，执行后写入结果并关闭
+    char line[CONTROL_LINE_SIZE]; //命令行，不含换行符
+    struct control_request* next;
+};
+
+struct control_channel {
+    int fd; //监听的套接字，停止后为-1
+    pthread_t thread;
+    pthread_mutex_t lock; //保护请求队列
+    struct control_request* head;
+    struct control_request* tail;
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    char dir[DUMP_PATH_SIZE]; //snapshot命令写入文件的目录，文件名中不能包含目录
+};
+
+// 监听线程收到命令时设置，在安全点中检查，只作为提示，请求队列由lock保护
+// 用__atomic_load_n/__atomic_store_n在两个线程间访问
+static int control_pending = 0;
+static struct control_channel* control = NULL;
+
+// control_channel(userdata)在registry中的key
+static char control_key;
+// 通过snapshot命令保存的快照表在registry中的key，以路径为key，用于diff命令，
+// 数组部分按保存的顺序记录路径
+static char control_snapshots_key;
+
+// 读取一行命令，客户端超时或断开时返回false
+// 每个连接只有一条命令，换行符之后的数据丢弃。每次recv受SO_RCVTIMEO限制，这里再限制整行的时间
+static bool control_read_line(int fd, char* line, size_t size)
+{
+    time_t deadline = time(NULL) + CONTROL_RECV_TIMEOUT;
+    size_t len = 0;
+    while (len + 1 < size) {
+        ssize_t n = recv(fd, line + len, size - 1 - len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        char* newline = (char*)memchr(line + len, '\n', (size_t)n);
+        if (newline != NULL) {
+            len = (size_t)(newline - line);
+            break;
+        }
+        len += (size_t)n;
+        if (time(NULL) >= deadline)
+            break;
+    }
+    // 没有换行符的最后一行也作为命令，只有空白字符的行忽略
+    while (len > 0 && isspace((unsigned char)line[len - 1]))
+        len--;
+    line[len] = 0;
+    size_t i = 0;
+    while (i < len && isspace((unsigned char)line[i]))
+        i++;
+    return i < len;
+}
+
+static void control_write(int fd, const char* str)
+{
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL; //客户端已断开时不产生SIGPIPE
+#else
+    int flags = 0;
+#endif
+    size_t len = strlen(str);
+    // 每次send受SO_SNDTIMEO限制，这里再限制总的时间，避免客户端每次只读取很少的数据
+    time_t deadline = time(NULL) + CONTROL_SEND_TIMEOUT;
+    while (len > 0) {
+        ssize_t n = send(fd, str, len, flags);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || time(NULL) > deadline)
+            return;
+        str += n;
+        len -= (size_t)n;
+    }
+}
+
+static void* control_thread(void* arg)
+{
+    struct control_channel* c = (struct control_channel*)arg;
+    for (;;) {
+        int fd = accept(c->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break; //停止时shutdown使accept返回错误
+        }
+        // 慢速的客户端不能阻塞监听线程太久，也不能在写回结果时阻塞VM所在的线程
+        struct timeval tv = { CONTROL_RECV_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        tv.tv_sec = CONTROL_SEND_TIMEOUT;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        struct control_request* r = (struct control_request*)calloc(1, sizeof(*r));
+        if (r == NULL || !control_read_line(fd, r->line, sizeof(r->line))) {
+            free(r);
+            close(fd);
+            continue;
+        }
+        r->fd = fd;
+        pthread_mutex_lock(&c->lock);
+        if (c->tail != NULL)
+            c->tail->next = r;
+        else
+            c->head = r;
+        c->tail = r;
+        pthread_mutex_unlock(&c->lock);
+        __atomic_store_n(&control_pending, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void free_requests(struct control_request* r)
+{
+    while (r != NULL) {
+        struct control_request* next = r->next;
+        close(r->fd);
+        free(r);
+        r = next;
+    }
+}
+
+// 停止监听线程，关闭套接字并删除文件，丢弃没有执行的请求
+static void stop_control(struct control_channel* c)
+{
+    if (c->fd < 0)
+        return;
+    shutdown(c->fd, SHUT_RDWR);
+    pthread_join(c->thread, NULL);
+    close(c->fd);
+    unlink(c->path);
+    c->fd = -1;
+    free_requests(c->head);
+    c->head = c->tail = NULL;
+    pthread_mutex_destroy(&c->lock);
+    if (control == c)
+        control = NULL;
+}
+
+static int control_channel_gc(lua_State* L)
+{
+    stop_control((struct control_channel*)lua_touserdata(L, 1));
+    return 0;
+}
+
+// 从快照表中删除name对应的快照并立即释放，不存在时返回false
+static bool drop_control_snapshot(lua_State* L, int snapshots, const char* name)
+{
+    int n = (int)lua_rawlen(L, snapshots);
+    int i;
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, snapshots, i);
+        bool found = strcmp(lua_tostring(L, -1), name) == 0;
+        lua_pop(L, 1);
+        if (found)
+            break;
+    }
+    if (i > n)
+        return false;
+    for (; i < n; ++i) {
+        lua_rawgeti(L, snapshots, i + 1);
+        lua_rawseti(L, snapshots, i);
+    }
+    lua_pushnil(L);
+    lua_rawseti(L, snapshots, n);
+    lua_getfield(L, snapshots, name);
+    free_snapshot(check_snapshot(L, -1));
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_setfield(L, snapshots, name);
+    return true;
+}
+
+// 以name保存栈顶的快照(出栈)，替换同名的快照，超过CONTROL_SNAPSHOTS_MAX个时释放最早保存的
+static void keep_control_snapshot(lua_State* L, int snapshots, const char* name)
+{
+    drop_control_snapshot(L, snapshots, name);
+    lua_setfield(L, snapshots, name);
+    int n = (int)lua_rawlen(L, snapshots);
+    lua_pushstring(L, name);
+    lua_rawseti(L, snapshots, ++n);
+    while (n-- > CONTROL_SNAPSHOTS_MAX) {
+        lua_rawgeti(L, snapshots, 1);
+        drop_control_snapshot(L, snapshots, lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+// 执行一条命令，结果压栈，出错时由lua_pcall捕获
+// stats: 统计结果; snapshot <name>: 在listen()指定的目录中写入压缩后的完整快照并保存在内存中;
+// diff <a> <b> [group] [depth]: 对比两个保存的快照，参数与diff_summary()相同;
+// drop <name>: 释放保存的快照
+static int control_exec(lua_State* L)
+{
+    char* line = (char*)lua_touserdata(L, 1);
+    const struct control_channel* c = (const struct control_channel*)lua_touserdata(L, 2);
+    char* save = NULL;
+    const char* cmd = strtok_r(line, " \t\v\f", &save);
+    const char* arg1 = strtok_r(NULL, " \t\v\f", &save);
+    const char* arg2 = strtok_r(NULL, " \t\v\f", &save);
+    const char* arg3 = strtok_r(NULL, " \t\v\f", &save);
+    const char* arg4 = strtok_r(NULL, " \t\v\f", &save);
+    char* str = NULL;
+    if (cmd == NULL) {
+        return luaL_error(L, "Empty command.");
+    } else if (strcmp(cmd, "stats") == 0) {
+        str = dump_string(L, false);
+    } else if (strcmp(cmd, "snapshot") == 0 && arg1 != NULL) {
+        // 客户端只能指定文件名，不能写入目录之外的文件
+        if (strchr(arg1, '/') != NULL || strcmp(arg1, ".") == 0 || strcmp(arg1, "..") == 0)
+            return luaL_error(L, "Invalid snapshot name: %s.", arg1);
+        char filename[DUMP_PATH_SIZE + CONTROL_LINE_SIZE];
+        snprintf(filename, sizeof(filename), "%s/%s", c->dir, arg1);
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &control_snapshots_key);
+        int snapshots = lua_gettop(L);
+        struct traverse_context ctx = {};
+        ctx.compact = COMPACT_DEFAULT_RUN;
+        struct lua_gc_node* root = capture(L, LUA_REGISTRYINDEX, "[REGISTRY]", &ctx);
+        struct snapshot_data* sd = push_snapshot(L, root);
+        sd->classes = ctx.classes;
+        sd->alloc_sites = ctx.alloc_sites;
+        keep_control_snapshot(L, snapshots, arg1);
+        str = lua_gc_node_to_jsonstr(root);
+        FILE* f = str != NULL ? fopen(filename, "wb+") : NULL;
+        if (f != NULL) {
+            fputs(str, f);
+            fclose(f);
+        }
+        cJSON_free(str);
+        if (f == NULL)
+            return luaL_error(L, "Failed to open file: %s to write.", filename);
+        lua_pushfstring(L, "ok %s\n", arg1);
+        return 1;
+    } else if (strcmp(cmd, "drop") == 0 && arg1 != NULL) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &control_snapshots_key);
+        if (!drop_control_snapshot(L, lua_gettop(L), arg1))
+            return luaL_error(L, "No snapshot taken at %s.", arg1);
+        lua_pushfstring(L, "ok %s\n", arg1);
+        return 1;
+    } else if (strcmp(cmd, "diff") == 0 && arg2 != NULL) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &control_snapshots_key);
+        lua_getfield(L, -1, arg1);
+        lua_getfield(L, -2, arg2);
+        if (lua_isnil(L, -2) || lua_isnil(L, -1))
+            return luaL_error(L, "No snapshot taken at %s.", lua_isnil(L, -2) ? arg1 : arg2);
+        lua_pushstring(L, arg3 != NULL ? arg3 : "type");
+        int group_by = luaL_checkoption(L, -1, NULL, group_by_names);
+        struct lua_gc_node_group* groups = NULL;
+        int depth = arg4 != NULL ? atoi(arg4) : 2;
+        lua_gc_node_diff_summary(check_snapshot(L, -3)->root, check_snapshot(L, -2)->root,
+            group_by, depth, &groups);
+        cJSON* object = cJSON_CreateObject();
+        groups_to_json(object, "diff", groups, "key");
+        lua_gc_node_group_free(groups);
+        str = cJSON_PrintUnformatted(object);
+        cJSON_Delete(object);
+    } else {
+        return luaL_error(L, "Unknown command: %s.", line);
+    }
+    if (str == NULL)
+        return luaL_error(L, "Out of memory.");
+    lua_pushfstring(L, "%s\n", str);
+    cJSON_free(str);
+    return 1;
+}
+
+// 在安全点中执行队列中的所有命令，本VM没有开启控制通道时返回false
+static bool handle_control(lua_State* L)
+{
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &control_key);
+    struct control_channel* c = (struct control_channel*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (c == NULL || c->fd < 0)
+        return false;
+    __atomic_store_n(&control_pending, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&c->lock);
+    struct control_request* r = c->head;
+    c->head = c->tail = NULL;
+    pthread_mutex_unlock(&c->lock);
+    bool handled = r != NULL;
+    while (r != NULL) {
+        lua_pushcfunction(L, control_exec);
+        lua_pushlightuserdata(L, r->line);
+        lua_pushlightuserdata(L, c);
+        if (lua_pcall(L, 2, 1, 0) != 0) {
+            lua_pushfstring(L, "error: %s\n", lua_tostring(L, -1));
+            lua_remove(L, -2);
+        }
+        control_write(r->fd, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        struct control_request* next = r->next;
+        close(r->fd);
+        free(r);
+        r = next;
+    }
+    return handled;
+}
+#endif
+
+// 滚动的泄漏检测：在安全点中按计划只做统计，保留最近几次按类型、类和函数定义位置统计的数量，
+// 找出持续增长的分组
+#define LEAK_WINDOW_MAX 32
+#define LEAK_WINDOW_DEFAULT 8
+#define LEAK_SERIES_MAX 1024
+
+// 分组方式，每种分组方式最多保留LEAK_SERIES_MAX / LEAK_GROUP_COUNT个分组，
+// 避免数量很多的函数定义位置占满所有的位置
+enum {
+    LEAK_GROUP_TYPE,
+    LEAK_GROUP_CLASS,
+    LEAK_GROUP_SOURCE,
+    LEAK_GROUP_COUNT
+};
+static const char* const leak_group_names[] = { "type", "class", "source" };
+
+// 一个分组最近几次统计的数量和大小，最早的在前
+struct leak_series {
+    char* key; //分组方式和名称，如"class:Player"
+    long counts[LEAK_WINDOW_MAX];
+    long sizes[LEAK_WINDOW_MAX];
+    int first; //第一次出现时在窗口中的位置，之前的数量未知
+    int group_by; //分组方式，LEAK_GROUP_*
+    int seen; //在最近一次统计中出现过
+    UT_hash_handle hh;
+};
+
+struct leak_detector {
+    int check; //大于0时设置count hook，为检查间隔的指令数，必须是第一个成员
+    double interval; //两次统计之间至少间隔的秒数
+    double budget; //统计所占CPU时间的比例上限
+    int sample; //统计时的抽样间隔，见stats()
+    int window; //保留的统计次数
+    int filled; //已经保留的统计次数，不超过window
+    long captures; //开启以来的统计次数
+    double cost; //最近一次统计所用的CPU时间(秒)
+    time_t next; //下一次统计的时间
+    time_t times[LEAK_WINDOW_MAX]; //每次统计的时间，最早的在前
+    struct leak_series* series;
+    int series_count[LEAK_GROUP_COUNT]; //各分组方式的分组数量
+    bool active; //停止或被替换后为false
+};
+
+// leak_detector(userdata)在registry中的key
+static char leak_key;
+// 开启了泄漏检测的VM数量，为0时安全点中不做检查
+static int leak_detectors = 0;
+
+// 停止检测并释放时间序列，可以重复调用
+static void release_leak_detector(struct leak_detector* d)
+{
+    struct leak_series* s;
+    struct leak_series* tmp;
+    HASH_ITER(hh, d->series, s, tmp)
+    {
+        HASH_DEL(d->series, s);
+        free(s->key);
+        free(s);
+    }
+    if (d->active) {
+        d->active = false;
+        leak_detectors--;
+    }
+}
+
+static int leak_detector_gc(lua_State* L)
+{
+    release_leak_detector((struct leak_detector*)lua_touserdata(L, 1));
+    return 0;
+}
+
+static void record_leak_groups(struct leak_detector* d, int group_by,
+    struct lua_gc_node_group* groups)
+{
+    char key[LUA_GC_NODE_DESC_SIZE + 256];
+    struct lua_gc_node_group* g;
+    for (g = groups; g != NULL; g = (struct lua_gc_node_group*)g->hh.next) {
+        snprintf(key, sizeof(key), "%s:%s", leak_group_names[group_by], g->key);
+        struct leak_series* s = NULL;
+        HASH_FIND_STR(d->series, key, s);
+        if (s == NULL) {
+            if (d->series_count[group_by] >= LEAK_SERIES_MAX / LEAK_GROUP_COUNT)
+                continue;
+            s = (struct leak_series*)calloc(1, sizeof(struct leak_series));
+            if (s == NULL)
+                continue;
+            s->key = strdup(key);
+            s->first = d->filled - 1;
+            s->group_by = group_by;
+            d->series_count[group_by]++;
+            HASH_ADD_KEYPTR(hh, d->series, s->key, strlen(s->key), s);
+        }
+        s->counts[d->filled - 1] = g->count;
+        s->sizes[d->filled - 1] = g->size;
+        s->seen = 1;
+    }
+}
+
+// 只做统计地遍历registry，并将结果追加到各分组的时间序列中，出错时由lua_pcall捕获
+static int leak_capture(lua_State* L)
+{
+    struct leak_detector* d = (struct leak_detector*)lua_touserdata(L, 1);
+    struct traverse_context ctx = {};
+    ctx.stats_only = true;
+    ctx.sample = d->sample;
+    ctx.sample_depth = 3;
+    clock_t start = clock();
+    capture(L, LUA_REGISTRYINDEX, "[REGISTRY]", &ctx);
+    struct lua_gc_node_group* types = NULL;
+    long count = 0;
+    long size = 0;
+    sum_stats(&ctx, &types, &count, &size);
+    // 窗口已满时丢弃最早的一次
+    struct leak_series* s;
+    struct leak_series* tmp;
+    if (d->filled == d->window) {
+        memmove(d->times, d->times + 1, sizeof(time_t) * (d->window - 1));
+        HASH_ITER(hh, d->series, s, tmp)
+        {
+            memmove(s->counts, s->counts + 1, sizeof(long) * (d->window - 1));
+            memmove(s->sizes, s->sizes + 1, sizeof(long) * (d->window - 1));
+            if (s->first > 0)
+                s->first--;
+        }
+    } else {
+        d->filled++;
+    }
+    d->times[d->filled - 1] = time(NULL);
+    HASH_ITER(hh, d->series, s, tmp)
+    {
+        s->seen = 0;
+    }
+    record_leak_groups(d, LEAK_GROUP_TYPE, types);
+    record_leak_groups(d, LEAK_GROUP_CLASS, ctx.classes);
+    record_leak_groups(d, LEAK_GROUP_SOURCE, ctx.sources);
+    lua_gc_node_group_free(types);
+    lua_gc_node_group_free(ctx.classes);
+    lua_gc_node_group_free(ctx.sources);
+    // 出现过的分组本次没有出现时数量为0，出现后都为0时删除
+    HASH_ITER(hh, d->series, s, tmp)
+    {
+        if (s->seen)
+            continue;
+        s->counts[d->filled - 1] = 0;
+        s->sizes[d->filled - 1] = 0;
+        int i;
+        for (i = s->first; i < d->filled && s->counts[i] == 0; ++i)
+            ;
+        if (i == d->filled) {
+            d->series_count[s->group_by]--;
+            HASH_DEL(d->series, s);
+            free(s->key);
+            free(s);
+        }
+    }
+    d->captures++;
+    d->cost = (double)(clock() - start) / CLOCKS_PER_SEC;
+    return 0;
+}
+
+// 到了计划的时间时统计一次，下一次的时间使统计所占CPU时间的比例不超过budget
+static bool check_leak(lua_State* L)
+{
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &leak_key);
+    struct leak_detector* d = (struct leak_detector*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    time_t now = time(NULL);
+    if (d == NULL || now < d->next)
+        return false;
+    lua_pushcfunction(L, leak_capture);
+    lua_pushlightuserdata(L, d);
+    bool ok = lua_pcall(L, 1, 0, 0) == 0;
+    if (!ok)
+        lua_pop(L, 1);
+    double wait = d->cost / d->budget - d->cost;
+    if (wait < d->interval)
+        wait = d->interval;
+    d->next = now + (time_t)ceil(wait);
+    return ok;
+}
+
+// 内存超过水位且过了冷却时间时写入快照，没有写入时返回false
+static bool check_watch(lua_State* L)
+{
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &watch_key);
+    struct memory_watch* w = (struct memory_watch*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (w == NULL || lua_gc(L, LUA_GCCOUNT, 0) < w->threshold_kb)
+        return false;
+    time_t now = time(NULL);
+    if (w->last != 0 && difftime(now, w->last) < w->cooldown)
+        return false;
+    w->last = now;
+    return pcall_dump(L, &w->ring);
+}
+
+// count hook，即执行Lua代码时的安全点，钩子执行期间不会再次触发钩子
+static void safepoint_hook(lua_State* L, lua_Debug* ar)
+{
+    (void)ar;
+    if (signal_count != signal_done)
+        handle_signal(L);
+#ifdef SNAPSHOT_CONTROL
+    if (__atomic_load_n(&control_pending, __ATOMIC_ACQUIRE))
+        handle_control(L);
+#endif
+    if (watchers > 0)
+        check_watch(L);
+    if (leak_detectors > 0)
+        check_leak(L);
+}
+
+// 取得安全点钩子所在的线程：主线程和当前线程，返回线程的数量
+static int safepoint_threads(lua_State* L, lua_State* threads[2])
+{
+#if LUA_VERSION_NUM >= 502
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#else
+    lua_getfield(L, LUA_REGISTRYINDEX, "mainthread");
+#endif
+    lua_State* mainL = lua_isthread(L, -1) ? lua_tothread(L, -1) : L;
+    lua_pop(L, 1);
+    threads[0] = mainL;
+    threads[1] = L;
+    return mainL == L ? 1 : 2;
+}
+
+// 根据watch、on_signal和leak_detect的设置，在主线程和当前线程上设置或移除钩子，之后新建的协程会继承创建者的钩子
+// 检查间隔取其中最小的，各userdata的第一个成员都是检查间隔
+static void update_safepoint_hook(lua_State* L)
+{
+    int count = 0;
+    const void* keys[3] = { &watch_key, &signal_key, &leak_key };
+    int i;
+    for (i = 0; i < 3; ++i) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, keys[i]);
+        int* check = (int*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        if (check != NULL && *check > 0 && (count == 0 || *check < count))
+            count = *check;
+    }
+    lua_State* threads[2];
+    int n = safepoint_threads(L, threads);
+    for (i = 0; i < n; ++i) {
+        if (count > 0)
+            lua_sethook(threads[i], safepoint_hook, LUA_MASKCOUNT, count);
+        else if (lua_gethook(threads[i]) == safepoint_hook)
+            lua_sethook(threads[i], NULL, 0, 0);
+    }
+}
+
+// 要设置钩子的线程上已经有其他钩子(如调试器)时报错
+static void check_foreign_hook(lua_State* L)
+{
+    lua_State* threads[2];
+    int n = safepoint_threads(L, threads);
+    int i;
+    for (i = 0; i < n; ++i) {
+        lua_Hook hook = lua_gethook(threads[i]);
+        if (hook != NULL && hook != safepoint_hook)
+            luaL_error(L, "A hook is already set.");
+    }
+}
+
+// watch(options)在内存超过水位时自动写入快照，watch(false)停止，返回之前是否已开启
+// options: threshold_kb必填, cooldown_s(默认60)，其余见parse_dump_ring
+static int snapshot_watch(lua_State* L)
+{
+    if (lua_gettop(L) != 1) {
+        luaL_error(L, "Number of arguments should be 1.");
+        return 0;
+    }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &watch_key);
+    struct memory_watch* old = (struct memory_watch*)lua_touserdata(L, -1);
+    bool watching = old != NULL;
+    lua_pop(L, 1);
+    if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+        if (old != NULL)
+            release_watch(old);
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &watch_key);
+        update_safepoint_hook(L);
+        lua_pushboolean(L, watching);
+        return 1;
+    }
+    luaL_checktype(L, 1, LUA_TTABLE);
+    struct memory_watch* w = (struct memory_watch*)lua_newuserdata(L, sizeof(struct memory_watch));
+    memset(w, 0, sizeof(*w));
+    parse_dump_ring(L, 1, &w->ring);
+    if (w->ring.check > 0)
+        check_foreign_hook(L);
+    lua_getfield(L, 1, "threshold_kb");
+    w->threshold_kb = (long)luaL_checkinteger(L, -1);
+    lua_getfield(L, 1, "cooldown_s");
+    w->cooldown = luaL_optnumber(L, -1, 60);
+    lua_pop(L, 2);
+    if (w->threshold_kb <= 0)
+        luaL_error(L, "Threshold should be a positive integer.");
+    if (w->cooldown < 0)
+        luaL_error(L, "Cooldown should not be negative.");
+    w->active = true;
+    watchers++;
+    // VM关闭时不再计数
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, memory_watch_gc);
+    lua_setfield(L, -2, "__gc");
     lua_setmetatable(L, -2);
+    if (old != NULL)
+        release_watch(old);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &watch_key);
+    update_safepoint_hook(L);
+    lua_pushboolean(L, watching);
+    return 1;
+}
+
 
+// on_signal(options)收到SIGUSR2后在下一个安全点写入快照，on_signal(false)停止，返回之前是否已开启
+// 信号处理函数只设置标志，check为0时不设置钩子，只在poll()中检查
+static int snapshot_on_signal(lua_State* L)
+{
+    if (lua_gettop(L) != 1) {
+        luaL_error(L, "Number of arguments should be 1.");
+        return 0;
+    }
+#ifdef SIGUSR2
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &signal_key);
+    struct signal_dump* old = (struct signal_dump*)lua_touserdata(L, -1);
+    bool enabled = old != NULL;
+    lua_pop(L, 1);
+    if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+        if (enabled)
+            release_signal_dump(old);
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &signal_key);
+        update_safepoint_hook(L);
+        lua_pushboolean(L, enabled);
+        return 1;
+    }
+    luaL_checktype(L, 1, LUA_TTABLE);
+    struct signal_dump* d = (struct signal_dump*)lua_newuserdata(L, sizeof(struct signal_dump));
+    memset(d, 0, sizeof(*d));
+    parse_dump_ring(L, 1, &d->ring);
+    if (d->ring.check > 0)
+        check_foreign_hook(L);
+    if (!acquire_signal_dump(d, old))
+        luaL_error(L, "Failed to install the signal handler.");
+    // VM关闭时释放对信号处理函数的引用
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, signal_dump_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &signal_key);
+    update_safepoint_hook(L);
+    lua_pushboolean(L, enabled);
+    return 1;
+#else
+    luaL_error(L, "SIGUSR2 is not supported on this platform.");
+    return 0;
+#endif
+}
+
+// listen(path[, dir])在Unix域套接字path上接收命令，snapshot命令的文件写入dir(默认为path所在的目录)，
+// listen(false)停止，返回之前是否已开启。命令在poll()或钩子中执行，每个连接执行一条命令
+static int snapshot_listen(lua_State* L)
+{
+    int nargs = lua_gettop(L);
+    if (nargs != 1 && nargs != 2) {
+        luaL_error(L, "Number of arguments should be 1 or 2.");
+        return 0;
+    }
+#ifdef SNAPSHOT_CONTROL
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &control_key);
+    struct control_channel* old = (struct control_channel*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    bool listening = old != NULL && old->fd >= 0;
+    if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+        if (old != NULL)
+            stop_control(old);
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &control_key);
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &control_snapshots_key);
+        lua_pushboolean(L, listening);
+        return 1;
+    }
+    const char* path = luaL_checkstring(L, 1);
+    if (listening || control != NULL)
+        luaL_error(L, "A control channel is already listening.");
+    struct control_channel* c = (struct control_channel*)lua_newuserdata(L, sizeof(struct control_channel));
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    if (strlen(path) >= sizeof(c->path))
+        luaL_error(L, "Path is too long.");
+    strcpy(c->path, path);
+    if (nargs == 2) {
+        const char* dir = luaL_checkstring(L, 2);
+        if (strlen(dir) >= sizeof(c->dir))
+            luaL_error(L, "Path is too long.");
+        strcpy(c->dir, dir);
+    } else {
+        const char* slash = strrchr(path, '/');
+        if (slash == NULL)
+            strcpy(c->dir, ".");
+        else if (slash == path)
+            strcpy(c->dir, "/");
+        else
+            snprintf(c->dir, sizeof(c->dir), "%.*s", (int)(slash - path), path);
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        luaL_error(L, "Failed to create socket: %s.", strerror(errno));
+    // 删除上次运行遗留的套接字文件，path是其他文件时由bind报错，不能删除
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    // 只允许同一用户连接，listen之前还不能连接，chmod之前没有可以利用的窗口
+    bool bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    if (!bound || chmod(path, 0600) != 0 || listen(fd, 8) != 0) {
+        int err = errno;
+        close(fd);
+        if (bound)
+            unlink(path);
+        luaL_error(L, "Failed to listen on %s: %s.", path, strerror(err));
+    }
+    c->fd = fd;
+    pthread_mutex_init(&c->lock, NULL);
+    if (pthread_create(&c->thread, NULL, control_thread, c) != 0) {
+        close(fd);
+        unlink(path);
+        c->fd = -1;
+        pthread_mutex_destroy(&c->lock);
+        luaL_error(L, "Failed to start the listener thread.");
+    }
+    control = c;
+    // VM关闭时停止监听线程
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, control_channel_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &control_key);
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &control_snapshots_key);
+    lua_pushboolean(L, listening);
+    return 1;
+#else
+    luaL_error(L, "Unix domain sockets are not supported on this platform.");
+    return 0;
+#endif
+}
+
+// leak_detect(options)开启泄漏检测，leak_detect(false)停止，返回之前是否已开启
+// options: interval_s(默认10)，budget(默认0.01)，window(默认8)，sample(默认1)，check(默认10000，为0时只在poll()中检查)
+static int snapshot_leak_detect(lua_State* L)
+{
+    if (lua_gettop(L) != 1) {
+        luaL_error(L, "Number of arguments should be 1.");
+        return 0;
+    }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &leak_key);
+    struct leak_detector* old = (struct leak_detector*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+        if (old != NULL)
+            release_leak_detector(old);
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &leak_key);
+        update_safepoint_hook(L);
+        lua_pushboolean(L, old != NULL);
+        return 1;
+    }
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "interval_s");
+    double interval = luaL_optnumber(L, -1, 10);
+    lua_getfield(L, 1, "budget");
+    double budget = luaL_optnumber(L, -1, 0.01);
+    lua_getfield(L, 1, "window");
+    int window = (int)luaL_optinteger(L, -1, LEAK_WINDOW_DEFAULT);
+    lua_getfield(L, 1, "sample");
+    int sample = (int)luaL_optinteger(L, -1, 1);
+    lua_getfield(L, 1, "check");
+    int check = (int)luaL_optinteger(L, -1, SAFEPOINT_CHECK_DEFAULT);
+    lua_pop(L, 5);
+    if (interval < 0)
+        luaL_error(L, "Interval should not be negative.");
+    if (budget <= 0 || budget > 1)
+        luaL_error(L, "Budget should be in (0, 1].");
+    if (window < 3 || window > LEAK_WINDOW_MAX)
+        luaL_error(L, "Window should be between 3 and %d.", LEAK_WINDOW_MAX);
+    if (sample < 1)
+        luaL_error(L, "Sample should be a positive integer.");
+    if (check < 0)
+        luaL_error(L, "Check should not be negative.");
+    if (check > 0)
+        check_foreign_hook(L);
+    struct leak_detector* d = (struct leak_detector*)lua_newuserdata(L, sizeof(struct leak_detector));
+    memset(d, 0, sizeof(*d));
+    d->check = check;
+    d->interval = interval;
+    d->budget = budget;
+    d->window = window;
+    d->sample = sample;
+    d->active = true;
+    leak_detectors++;
+    // 时间序列保存在native内存中，VM关闭时释放
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, leak_detector_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    // 重新设置时丢弃已有的时间序列
+    if (old != NULL)
+        release_leak_detector(old);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &leak_key);
+    update_safepoint_hook(L);
+    lua_pushboolean(L, old != NULL);
+    return 1;
+}
+
+// 持续增长的分组及其斜率
+struct leak_growth {
+    const struct leak_series* series;
+    double slope; //每次统计增加的数量
+    double size_slope; //每次统计增加的大小
+    double rate; //每秒增加的数量，统计的时间跨度为0时为负数
+    int samples; //分组出现以后的统计次数
+};
+
+// 对y关于x做最小二乘直线拟合，返回斜率
+static double fit_slope(const double* x, const long* y, int n)
+{
+    double mx = 0, my = 0;
+    int i;
+    for (i = 0; i < n; ++i) {
+        mx += x[i];
+        my += (double)y[i];
+    }
+    mx /= n;
+    my /= n;
+    double sxy = 0, sxx = 0;
+    for (i = 0; i < n; ++i) {
+        sxy += (x[i] - mx) * ((double)y[i] - my);
+        sxx += (x[i] - mx) * (x[i] - mx);
+    }
+    return sxx > 0 ? sxy / sxx : 0;
+}
+
+static int compare_growth(const void* a, const void* b)
+{
+    double sa = ((const struct leak_growth*)a)->size_slope;
+    double sb = ((const struct leak_growth*)b)->size_slope;
+    return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+// 返回泄漏检测的结果{ captures = 统计次数, cost = 最近一次统计的CPU时间, growing = 持续增长的分组 }，
+// growing中每个元素为{ group = 分组方式, key = 分组名称, count, size, slope, size_slope, rate, samples }，
+// 按size_slope降序排列。没有开启时返回nil
+static int snapshot_leak_report(lua_State* L)
+{
+    if (lua_gettop(L) != 0) {
+        luaL_error(L, "Number of arguments should be 0.");
+        return 0;
+    }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &leak_key);
+    struct leak_detector* d = (struct leak_detector*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (d == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    int n = d->filled;
+    double index[LEAK_WINDOW_MAX];
+    double seconds[LEAK_WINDOW_MAX];
+    int i;
+    for (i = 0; i < n; ++i) {
+        index[i] = i;
+        seconds[i] = difftime(d->times[i], d->times[0]);
+    }
+    // 先算出结果再生成返回值，生成返回值时不会修改时间序列
+    struct leak_growth* growths = (struct leak_growth*)malloc(sizeof(struct leak_growth) * (HASH_COUNT(d->series) + 1));
+    if (growths == NULL) {
+        luaL_error(L, "Out of memory.");
+        return 0;
+    }
+    int ngrowths = 0;
+    const struct leak_series* s;
+    for (s = d->series; s != NULL; s = (const struct leak_series*)s->hh.next) {
+        // 只看分组出现以后的统计，之前的数量未知，不能当作0
+        int first = s->first;
+        int m = n - first;
+        if (m < 3)
+            continue;
+        // 至少三分之二的统计比上一次多，并且最后一次比第一次多，只增长一次的不算
+        int ups = 0;
+        for (i = first + 1; i < n; ++i) {
+            if (s->counts[i] > s->counts[i - 1])
+                ups++;
+        }
+        if (ups * 3 < (m - 1) * 2 || s->counts[n - 1] <= s->counts[first])
+            continue;
+        struct leak_growth* g = &growths[ngrowths++];
+        g->series = s;
+        g->samples = m;
+        g->slope = fit_slope(index + first, s->counts + first, m);
+        g->size_slope = fit_slope(index + first, s->sizes + first, m);
+        g->rate = seconds[n - 1] > seconds[first] ? fit_slope(seconds + first, s->counts + first, m) : -1;
+    }
+    qsort(growths, ngrowths, sizeof(struct leak_growth), compare_growth);
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, d->captures);
+    lua_setfield(L, -2, "captures");
+    lua_pushnumber(L, d->cost);
+    lua_setfield(L, -2, "cost");
+    lua_createtable(L, ngrowths, 0);
+    for (i = 0; i < ngrowths; ++i) {
+        const struct leak_growth* g = &growths[i];
+        const char* colon = strchr(g->series->key, ':');
+        lua_createtable(L, 0, 8);
+        lua_pushlstring(L, g->series->key, colon - g->series->key);
+        lua_setfield(L, -2, "group");
+        lua_pushstring(L, colon + 1);
+        lua_setfield(L, -2, "key");
+        lua_pushinteger(L, g->series->counts[n - 1]);
+        lua_setfield(L, -2, "count");
+        lua_pushinteger(L, g->series->sizes[n - 1]);
+        lua_setfield(L, -2, "size");
+        lua_pushnumber(L, g->slope);
+        lua_setfield(L, -2, "slope");
+        lua_pushnumber(L, g->size_slope);
+        lua_setfield(L, -2, "size_slope");
+        if (g->rate >= 0) {
+            lua_pushnumber(L, g->rate);
+            lua_setfield(L, -2, "rate");
+        }
+        lua_pushinteger(L, g->samples);
+        lua_setfield(L, -2, "samples");
+        lua_rawseti(L, -2, i + 1);
+    }
+    free(growths);
+    lua_setfield(L, -2, "growing");
+    return 1;
+}
+
+// 由宿主在主循环中调用的安全点，没有待处理的请求时只检查标志
+// 写入了快照、执行了命令或做了泄漏检测的统计时返回true
+static int snapshot_poll(lua_State* L)
+{
+    bool handled = false;
+    if (signal_count != signal_done)
+        handled = handle_signal(L);
+    if (watchers > 0)
+        handled = check_watch(L) || handled;
+    if (leak_detectors > 0)
+        handled = check_leak(L) || handled;
+#ifdef SNAPSHOT_CONTROL
+    if (__atomic_load_n(&control_pending, __ATOMIC_ACQUIRE))
+        handled = handle_control(L) || handled;
+#endif
+    lua_pushboolean(L, handled);
     return 1;
 }
 
@@ -683,6 +3889,9 @@ static int snapshot_decreased(lua_State* L) { return snapshot_diff(L, false); }
 static struct luaL_Reg snapshot_lib[] = {
     { "snapshot",
         snapshot }, // 保存当前时刻的某一table或registry的快照，并返回一个snapshot(userdata)对象
+    { "new_since",
+        snapshot_new_since }, // 对比baseline进行快照，只保留新增的对象和size增加的table
+    { "stats", snapshot_stats }, // 只统计对象的数量和大小，不生成快照
     { "print", snapshot_print }, // 转换为字符串，并打印
     { "print_jsonfmt",
         snapshot_print_jsonfmt }, // 转换为格式化过的json字符串，并打印
@@ -693,6 +3902,30 @@ static struct luaL_Reg snapshot_lib[] = {
         snapshot_tojsonfile_nofmt }, // 转换为未格式化过的json字符串，并输出到指定文件
     { "to_jsonfilefmt",
         snapshot_tojsonfile_fmt }, // 转换为格式化过的json字符串，并输出到指定文件
+    { "to_folded",
+        snapshot_tofolded }, // 转换为折叠栈(flamegraph)格式，并输出到指定文件
+    { "nodes", snapshot_nodes }, // 返回逐个遍历snapshot节点的迭代器
+    { "find", snapshot_find }, // 根据lua对象的指针查找节点
+    { "find_path", snapshot_find_path }, // 根据link路径查找节点
+    { "survivors",
+        snapshot_survivors }, // 求出在s2中新增，且在s3...sn中仍然存活的对象
+    { "diff_summary",
+        snapshot_diff_summary }, // 求出snapshot1 到 snapshot2 的差别的分组统计
+    { "class_histogram",
+        snapshot_class_histogram }, // 按metatable统计实例的数量和大小
+    { "cross_edges",
+        snapshot_cross_edges }, // 返回多根快照中跨越根对象的引用
+    { "track_alloc",
+        snapshot_track_alloc }, // 开启或关闭对VM内存分配的统计
+    { "alloc_stats", snapshot_alloc_stats }, // 返回内存分配的统计
+    { "alloc_samples", snapshot_alloc_samples }, // 返回存活的采样对象及其分配时的调用栈
+    { "alloc_sites", snapshot_alloc_sites }, // 返回快照中仍然存活的采样对象及其分配时的调用栈
+    { "watch", snapshot_watch }, // 内存超过水位时自动写入快照文件
+    { "on_signal", snapshot_on_signal }, // 收到SIGUSR2后在下一个安全点写入快照文件
+    { "poll", snapshot_poll }, // 由宿主调用的安全点，处理待写入的快照和控制通道的命令
+    { "listen", snapshot_listen }, // 在Unix域套接字上接收stats、snapshot、diff、drop命令
+    { "leak_detect", snapshot_leak_detect }, // 在安全点中按计划统计，检测持续增长的分组
+    { "leak_report", snapshot_leak_report }, // 返回持续增长的分组及其斜率
     { "free", snapshot_free }, // 手动释放snapshot所占用的内存
     { "copy", snapshot_copy }, // 复制snapshot
     { "incr", snapshot_increased }, // 求出snapshot1 到 snapshot2
@@ -710,6 +3943,20 @@ int luaopen_snapshot(lua_State* L)
     lua_pushcfunction(L, lua_gc_node_gc);
     lua_rawset(L, -3);
     lua_pop(L, 1);
+#ifdef SNAPSHOT_LUAJIT
+    // 计算cdata的大小需要ffi.sizeof，加载失败时cdata只计算头部的大小
+    lua_pushlightuserdata(L, &cdata_sizeof_key);
+    lua_getglobal(L, "require");
+    lua_pushliteral(L, LUA_FFILIBNAME);
+    if (lua_pcall(L, 1, 1, 0) == 0 && lua_istable(L, -1)) {
+        lua_getfield(L, -1, "sizeof");
+        lua_remove(L, -2);
+    } else {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    lua_rawset(L, LUA_REGISTRYINDEX);
+#endif
     luaL_newlib(L, snapshot_lib);
     lua_pushvalue(L, -1);
     lua_setglobal(L, "snapshot");
@@ -0,0 +1,27 @@
+snapshot = require "snapshot"
+
+tbl = {
+	["A"] = {1, 2, 3},
+	["B"] = {
+		["BB"] = {},
+	},
+	["f"] = function() end,
+}
+
+S = snapshot.snapshot(tbl, "tbl")
+
+for ptr, type, refs, size, link, parent, desc in snapshot.nodes(S) do
+	print(ptr, type, refs, size, link, parent, desc)
+end
+
+print("================ functions only ================")
+for ptr, type, refs, size, link in snapshot.nodes(S, "function") do
+	print(ptr, type, link)
+end
+
+print("================ tables larger than 100 bytes ================")
+for ptr, type, refs, size, link in snapshot.nodes(S, function(ptr, type, refs, size)
+	return type == "table" and size > 100
+end) do
+	print(ptr, type, size, link)
+end
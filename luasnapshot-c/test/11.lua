@@ -0,0 +1,33 @@
+snapshot = require "snapshot"
+
+tmp = {
+    player = {
+        uid = 1,
+        camps = {
+            {campid = 1},
+            {campid = 2},
+        },
+    },
+}
+
+S = snapshot.snapshot(_G, "_G")
+
+print(snapshot.find(S, tmp.player))
+print(snapshot.find(S, tostring(tmp.player.camps)))
+print(snapshot.find(S, {}))
+
+print(snapshot.find_path(S, "_G.tmp.player.camps"))
+print(snapshot.find_path(S, "_G.tmp.player.camps.[1]"))
+print(snapshot.find_path(S, "_G.tmp.nothing"))
+
+-- 查询过的snapshot仍然可以求增量
+tmp.player.camps[3] = {campid = 3}
+S2 = snapshot.snapshot(_G, "_G")
+snapshot.print(snapshot.incr(S, S2))
+print(snapshot.find(S2, tmp.player.camps[3]))
+
+-- link本身含有'.'，且与更短的link有相同前缀时需要回溯
+dotted = {a = {x = 1}, ["a.b"] = {c = {}}}
+S3 = snapshot.snapshot(_G, "_G")
+print(snapshot.find_path(S3, "_G.dotted.a.b.c") ~= nil)
+print(snapshot.find_path(S3, "_G.dotted.a.x") == nil)
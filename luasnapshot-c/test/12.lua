@@ -0,0 +1,38 @@
+snapshot = require "snapshot"
+
+tmp = {
+    player = {
+        uid = 1,
+        camps = {
+            {campid = 1},
+            {campid = 2},
+        },
+    },
+}
+
+init = snapshot.snapshot(_G, "_G")
+
+tmp.player.camps[3] = {campid = 3}
+tmp.player2 = {roleid = 2}
+foo = function() end
+
+print("================ incr ================")
+snapshot.print(snapshot.incr(init, snapshot.snapshot(_G, "_G")))
+print("================ new_since ================")
+snapshot.print(snapshot.new_since(init, _G, "_G"))
+
+-- 与test/8.lua相同的泄漏检查循环，但每次迭代不再创建完整的快照
+a = {}
+for i = 1, 400 do
+	table.insert(a, {})
+	collectgarbage("step")
+	diff = snapshot.new_since(init, _G, "_G")
+	if i % 200 == 0 then
+		snapshot.print(diff)
+	end
+end
+
+-- 与snapshot()相同，根的名称为nil时使用空字符串
+diff = snapshot.new_since(init, { x = {} }, nil)
+assert(type(diff) == "userdata")
+assert(not pcall(snapshot.new_since, init, {}, {}))
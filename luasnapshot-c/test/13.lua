@@ -0,0 +1,25 @@
+snapshot = require "snapshot"
+
+cache = {}
+temp = {}
+
+local function workload(n)
+	for i = 1, n do
+		-- cache中的对象会一直存活，temp中的对象会在下一次调用时被清除
+		cache[#cache + 1] = {id = i}
+		temp[i] = {id = i}
+	end
+end
+
+A = snapshot.snapshot(_G, "_G")
+workload(3)
+B = snapshot.snapshot(_G, "_G")
+temp = {}
+workload(2)
+C = snapshot.snapshot(_G, "_G")
+
+S, ranking = snapshot.survivors(A, B, C)
+snapshot.print(S)
+for _, item in ipairs(ranking) do
+	print(item.path, item.count, item.size)
+end
@@ -0,0 +1,39 @@
+snapshot = require "snapshot"
+
+Player = {__name = "Player"}
+Player.__index = Player
+Monster = {}
+Monster.__index = Monster
+
+players = {}
+monsters = {}
+
+S1 = snapshot.snapshot(_G, "_G")
+
+for i = 1, 3 do
+	players[i] = setmetatable({id = i}, Player)
+end
+monsters[1] = setmetatable({}, Monster)
+handlers = {function() end, function() end}
+
+S2 = snapshot.snapshot(_G, "_G")
+
+for _, group_by in ipairs({"type", "source", "class", "path"}) do
+	print("================ " .. group_by .. " ================")
+	for _, item in ipairs(snapshot.diff_summary(S1, S2, group_by)) do
+		print(item.key, item.count, item.size)
+	end
+end
+
+print("================ decrease ================")
+for _, item in ipairs(snapshot.diff_summary(S2, S1, "path", 3)) do
+	print(item.key, item.count, item.size)
+end
+
+print("================ invalid argument ================")
+print(pcall(snapshot.free, io.stdout))
+print(pcall(snapshot.diff_summary, S1, io.stdout, "type"))
+print(pcall(snapshot.incr, S1, {}))
+print(pcall(snapshot.copy, io.stdout))
+snapshot.free(S1)
+snapshot.free(S2)
@@ -0,0 +1,25 @@
+snapshot = require "snapshot"
+
+Player = {__name = "Player"}
+Player.__index = Player
+Monster = {}
+Monster.__index = Monster
+
+players = {}
+monsters = {}
+for i = 1, 3 do
+	players[i] = setmetatable({id = i}, Player)
+end
+for i = 1, 2 do
+	monsters[i] = setmetatable({hp = 100}, Monster)
+end
+
+S = snapshot.snapshot(_G, "_G")
+for _, item in ipairs(snapshot.class_histogram(S)) do
+	print(item.class, item.count, item.size)
+end
+
+print("================ copy ================")
+for _, item in ipairs(snapshot.class_histogram(snapshot.copy(S))) do
+	print(item.class, item.count, item.size)
+end
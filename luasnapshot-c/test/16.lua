@@ -0,0 +1,45 @@
+snapshot = require "snapshot"
+
+Player = {__name = "Player"}
+Player.__index = Player
+
+players = {}
+for i = 1, 100 do
+	players[i] = setmetatable({id = i}, Player)
+end
+
+function make_closure(i)
+	return function() return i end
+end
+closures = {}
+for i = 1, 10 do
+	closures[i] = make_closure(i)
+end
+
+local st = snapshot.stats(_G)
+print("count", st.count, "size", st.size)
+for _, item in ipairs(st.types) do
+	print(item.type, item.count, item.size)
+end
+for _, item in ipairs(st.classes) do
+	print(item.class, item.count, item.size)
+end
+for i = 1, 3 do
+	local item = st.sources[i]
+	if item then print(item.source, item.count, item.size) end
+end
+
+-- 与完整快照的统计结果一致
+local S = snapshot.snapshot(_G, "_G")
+local count, size = 0, 0
+for _, _, _, sz in snapshot.nodes(S) do
+	count = count + 1
+	size = size + sz
+end
+assert(count == st.count and size == st.size)
+print("same as snapshot():", count, size)
+
+-- 其他根对象中引用的_G表不展开，与snapshot(root)一致
+local root = { g = _G, x = {} }
+assert(snapshot.stats(root).count == 2)
+assert(snapshot.stats(_G).count == st.count)
@@ -0,0 +1,28 @@
+snapshot = require "snapshot"
+
+Player = {__name = "Player"}
+Player.__index = Player
+
+players = {}
+for i = 1, 20000 do
+	players[i] = setmetatable({id = i, items = {i}}, Player)
+end
+
+local exact = snapshot.stats(_G)
+print("exact", exact.count, exact.size)
+
+-- _G(0) -> players(1) -> player(2)，深度不小于2的table只展开约1/16
+local st = snapshot.stats(_G, {sample = 16, depth = 2})
+print("sample", st.sample, st.count, st.count_err, st.size, st.size_err)
+for _, item in ipairs(st.types) do
+	print(item.type, item.count, item.count_err, item.size, item.size_err)
+end
+for _, item in ipairs(st.classes) do
+	print(item.class, item.count, item.size)
+end
+assert(math.abs(st.count - exact.count) <= 4 * st.count_err)
+assert(math.abs(st.size - exact.size) <= 4 * st.size_err)
+
+-- 抽样结果只取决于对象的地址，对同一对象的多次统计结果一致
+local st2 = snapshot.stats(_G, {sample = 16, depth = 2})
+assert(st2.count == st.count and st2.size == st.size)
@@ -0,0 +1,43 @@
+snapshot = require "snapshot"
+
+config = {
+	a = {b = {c = {d = {}}}},
+}
+cache = {}
+for i = 1, 1000 do
+	cache[i] = {i}
+end
+ignored = {big = {}}
+for i = 1, 100 do
+	ignored.big[i] = {}
+end
+
+-- max_depth：深度大于2的对象不展开，根节点深度为0
+local S1 = snapshot.snapshot(config, "config", {max_depth = 2})
+snapshot.print(S1)
+
+-- exclude：被排除的table不展开，可以是table或link路径
+local S2 = snapshot.snapshot{root = _G, name = "_G", exclude = {package.loaded, "_G.ignored", "_G.config.a"}}
+assert(snapshot.find_path(S2, "_G.ignored") == nil)
+assert(snapshot.find_path(S2, "_G.config") ~= nil)
+assert(snapshot.find_path(S2, "_G.config.a") == nil)
+assert(snapshot.find(S2, cache[1]) ~= nil)
+
+-- max_children：每个节点最多展开10个子节点，其余的汇总为一个聚合节点
+local S3 = snapshot.snapshot(cache, "cache", {max_children = 10})
+local count, aggregate = 0
+for ptr, type, refs, size, link, parent, desc in snapshot.nodes(S3) do
+	count = count + 1
+	if type == "aggregate" then
+		aggregate = desc
+		print(link, size, desc)
+	end
+end
+print("nodes", count)
+assert(count == 1 + 10 + 1)
+assert(aggregate == "(aggregate: 990)")
+
+-- 负数的max_children、max_depth和compact是错误的参数
+assert(not pcall(snapshot.snapshot, cache, "cache", {max_children = -1}))
+assert(not pcall(snapshot.snapshot, cache, "cache", {max_depth = -1}))
+assert(not pcall(snapshot.snapshot, cache, "cache", {compact = -1}))
@@ -0,0 +1,38 @@
+snapshot = require "snapshot"
+
+Camp = {__name = "Camp"}
+camps = {}
+for i = 1, 1000 do
+	camps[i] = setmetatable({id = i, pos = {x = i, y = i}}, Camp)
+end
+camps.name = {}
+
+local function dump(S)
+	for ptr, type, refs, size, link, parent, desc in snapshot.nodes(S) do
+		print(type, refs, size, link, desc)
+	end
+end
+
+-- 同类的数组元素被折叠为一个聚合节点
+local S1 = snapshot.snapshot(camps, "camps", {compact = true})
+dump(S1)
+for _, item in ipairs(snapshot.class_histogram(S1)) do
+	print(item.class, item.count, item.size)
+end
+
+-- diff按数量比较聚合节点
+for i = 1001, 1100 do
+	camps[i] = setmetatable({id = i, pos = {x = i, y = i}}, Camp)
+end
+local S2 = snapshot.snapshot(camps, "camps", {compact = true})
+print("================ incr ================")
+snapshot.print(snapshot.incr(S1, S2))
+for _, item in ipairs(snapshot.diff_summary(S1, S2, "class")) do
+	print(item.key, item.count, item.size)
+end
+
+-- 少于compact个的同类元素不折叠
+local S3 = snapshot.snapshot({{}, {}, {}}, "small", {compact = 4})
+local count = 0
+for _ in snapshot.nodes(S3) do count = count + 1 end
+assert(count == 4)
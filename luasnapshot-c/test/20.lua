@@ -0,0 +1,33 @@
+snapshot = require "snapshot"
+
+shared = {}
+moduleA = {data = {1, 2, 3}, shared = shared}
+moduleB = {list = {}, ref = shared, a = moduleA.data}
+moduleC = moduleA
+
+-- 多个根对象共享同一个已访问集合，共享的对象只归属于第一个访问到它的根对象
+local S = snapshot.snapshot{roots = {{moduleA, "A"}, {moduleB, "B"}, {moduleC, "C"}}}
+snapshot.print(S)
+
+for _, edge in ipairs(snapshot.cross_edges(S)) do
+	print(edge.from, "->", edge.to)
+end
+assert(snapshot.find_path(S, "[ROOTS].A.shared") ~= nil)
+assert(snapshot.find_path(S, "[ROOTS].B.ref") == nil)
+assert(#snapshot.cross_edges(S) == 3)
+
+-- 选项同样适用于多根快照
+local S2 = snapshot.snapshot{roots = {{moduleA, "A"}, {moduleB, "B"}}, exclude = {"B.list"}}
+assert(snapshot.find_path(S2, "[ROOTS].B.list") == nil)
+assert(snapshot.find_path(S2, "[ROOTS].A.data") ~= nil)
+
+-- [ROOTS]是类型为roots的虚拟节点，不是聚合节点，也不计入统计
+local _, type = snapshot.find_path(S, "[ROOTS]")
+assert(type == "roots")
+for ptr, type, refs, size, link in snapshot.nodes(S, "aggregate") do
+	assert(link ~= "[ROOTS]")
+end
+local S3 = snapshot.snapshot(moduleB, "B")
+for _, item in ipairs(snapshot.diff_summary(S3, S, "type")) do
+	assert(item.key ~= "roots" and item.key ~= "aggregate")
+end
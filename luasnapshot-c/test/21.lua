@@ -0,0 +1,41 @@
+snapshot = require "snapshot"
+
+local request_of, counter_of = {}, {}
+local function session(id, ...)
+	local request = {id = id}
+	local counter = {0}
+	local function step()
+		counter[1] = counter[1] + 1
+		return counter[1]
+	end
+	request_of[id], counter_of[id] = request, counter
+	while true do
+		step()
+		coroutine.yield()
+	end
+end
+
+-- 挂起的协程：局部变量、可变参数和调用中的函数的upvalue
+local vararg = {vararg = true}
+suspended = coroutine.create(session)
+coroutine.resume(suspended, 1, vararg)
+-- 未启动的协程：主函数在栈上
+unstarted = coroutine.wrap(function(...) end)
+unstarted_co = coroutine.create(function(t) return t end)
+-- 出错结束的协程：错误对象
+local err = {err = true}
+dead = coroutine.create(function(t) error(t) end)
+coroutine.resume(dead, err)
+
+-- 只通过协程栈引用的对象
+local r, c = request_of[1], counter_of[1]
+request_of, counter_of = nil, nil
+local S = snapshot.snapshot(_G, "_G")
+for _, obj in ipairs({r, c, vararg, err}) do
+	local ptr, type, refs, size, link, parent, desc = snapshot.find(S, obj)
+	print(type, link, desc)
+	assert(ptr ~= nil)
+end
+for ptr, type, refs, size, link, parent, desc in snapshot.nodes(S, "thread") do
+	print(link, desc)
+end
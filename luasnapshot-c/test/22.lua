@@ -0,0 +1,41 @@
+snapshot = require "snapshot"
+
+local function factory_a(i) return function() return i end end
+local function factory_b(i) return function() return -i end end
+
+local function check(S, line)
+	local count = 0
+	for ptr, type, refs, size, link, parent, desc in snapshot.nodes(S, "function") do
+		if parent and select(5, snapshot.find(S, parent)) == "fs" then
+			assert(desc == "(func: 22.lua:" .. line .. ")", desc)
+			count = count + 1
+		end
+	end
+	return count
+end
+
+fs = {}
+for i = 1, 100 do fs[i] = factory_a(i) end
+-- 多次快照的函数描述一致
+print(check(snapshot.snapshot(_G, "_G"), 3), check(snapshot.snapshot(_G, "_G"), 3))
+
+-- 闭包被回收后，新的闭包即使地址相同也不会使用旧的描述
+fs = {}
+collectgarbage()
+for i = 1, 100 do fs[i] = factory_b(i) end
+print(check(snapshot.snapshot(_G, "_G"), 4))
+
+-- 快照不在VM中分配对象，快照前后对象数量不变
+local c1 = snapshot.stats().count
+local c2 = snapshot.stats().count
+assert(c1 == c2)
+
+-- 同一原型的闭包共用缓存的描述；源文件名的字符串被回收后地址可能被复用，描述仍然正确
+for _, name in ipairs({ "chunk_x", "chunk_y", "chunk_x" }) do
+	g = (loadstring or load)("return function() end", "=" .. name)()
+	collectgarbage()
+	local S = snapshot.snapshot(_G, "_G")
+	local desc = select(7, snapshot.find_path(S, "_G.g"))
+	assert(desc == "(func: " .. name .. ":1)", desc)
+end
+g = nil
@@ -0,0 +1,49 @@
+snapshot = require "snapshot"
+
+-- Lua 5.1没有lua_upvalueid，LuaJIT中有
+if _VERSION == "Lua 5.1" and not jit then
+	return
+end
+
+-- 同一工厂创建的闭包共享upvalue
+local function factory(state)
+	local shared = {state = state}
+	local closures = {}
+	for i = 1, 1000 do
+		closures[i] = function() return shared, i end
+	end
+	return closures
+end
+closures = factory("idle")
+
+local S = snapshot.snapshot(_G, "_G")
+local cells, refs = 0, 0
+for ptr, type, r, size, link, parent, desc in snapshot.nodes(S, "upvalue") do
+	cells = cells + 1
+	refs = r
+	print(type, r, size, link)
+end
+-- 1000个闭包只有一个upvalue节点，其引用数为闭包数量，共享的table只遍历一次
+assert(cells == 1 and refs == 1000)
+local ptr, type, r, size, link = snapshot.find_path(S, "_G.closures.[1].shared.[value]")
+print(type, r, size, link)
+assert(type == "table" and r == 1)
+
+-- upvalue节点不计入深度：_G深度0，closures深度1，闭包深度2，upvalue的值深度3
+local S2 = snapshot.snapshot(_G, "_G", {max_depth = 3})
+assert(snapshot.find_path(S2, "_G.closures.[1].shared.[value]") ~= nil)
+local S3 = snapshot.snapshot(_G, "_G", {max_depth = 2})
+assert(snapshot.find_path(S3, "_G.closures.[1].shared.[value]") == nil)
+
+-- 更深的闭包先遍历到共享的upvalue时，其值被深度截断，不能因此影响更浅的闭包
+do
+	local s = {payload = {}}
+	local deep = function() return s end
+	local shallow = function() return s end
+	root2 = {[1] = {[1] = {[1] = deep}}, [2] = shallow}
+end
+local S4 = snapshot.snapshot(root2, "r", {max_depth = 3})
+assert(snapshot.find_path(S4, "r.[1].[1].[1].s") == nil)
+local ptr, type, r = snapshot.find_path(S4, "r.[2].s")
+assert(type == "upvalue" and r == 1)
+assert(snapshot.find_path(S4, "r.[2].s.[value]") ~= nil)
@@ -0,0 +1,46 @@
+snapshot = require "snapshot"
+
+-- cdata只在LuaJIT中存在
+if not jit then
+	return
+end
+local ffi = require "ffi"
+ffi.cdef [[
+typedef struct { double x, y, z; } vec3;
+]]
+
+particles = {}
+for i = 1, 100 do
+	particles[i] = ffi.new("vec3", i, i, i)
+end
+buffer = ffi.new("uint8_t[?]", 4096)
+
+local S = snapshot.snapshot(_G, "_G")
+local count, size = 0, 0
+for ptr, type, refs, sz, link in snapshot.nodes(S, "cdata") do
+	count = count + 1
+	size = size + sz
+end
+print(count, size)
+assert(count == 101)
+-- 每个cdata的大小为头部加上ffi.sizeof
+assert(size == 100 * (16 + 24) + 16 + 4096)
+assert(snapshot.find(S, buffer))
+
+local st = snapshot.stats(_G)
+local found = false
+for _, item in ipairs(st.types) do
+	if item.type == "cdata" then
+		found = true
+		print(item.type, item.count, item.size)
+		assert(item.count == 101 and item.size == size)
+	end
+end
+assert(found)
+
+-- 函数的环境表不是全局表时才遍历
+-- 环境表只能通过函数访问，否则可能先从_G.sandbox访问到
+local sandbox = {print = print}
+sandboxed = setfenv(function() return print end, sandbox)
+S = snapshot.snapshot(_G, "_G")
+assert(snapshot.find_path(S, "_G.sandboxed.[environment]"))
@@ -0,0 +1,51 @@
+snapshot = require "snapshot"
+
+-- 弱引用的value和key记录为弱引用的边，不拥有被引用的对象
+players = {}
+for i = 1, 10 do
+	players[i] = {id = i}
+end
+cache = setmetatable({}, {__mode = "v"})
+for i = 1, 10 do
+	cache["player" .. i] = players[i]
+end
+cache.orphan = {}
+owners = setmetatable({}, {__mode = "k"})
+owners[players[1]] = true
+
+local S = snapshot.snapshot(_G, "_G")
+snapshot.print(S)
+
+-- 被缓存的对象仍然属于players，缓存中只有数量和大小为0的边
+local weak, orphan = 0, 0
+for ptr, type, refs, size, link, parent, desc in snapshot.nodes(S, "weak") do
+	weak = weak + 1
+	assert(size == 0 and desc == "(weak)")
+	if link == "orphan" then
+		orphan = orphan + 1
+	end
+end
+assert(weak == 12)
+assert(orphan == 1)
+assert(snapshot.find_path(S, "_G.players.[1]") ~= nil)
+assert(select(2, snapshot.find(S, players[1])) == "table")
+local _, _, _, _, _, _, desc = snapshot.find_path(S, "_G.cache")
+assert(desc:find("(weak: 11)", 1, true))
+_, _, _, _, _, _, desc = snapshot.find_path(S, "_G.owners")
+assert(desc:find("(weak: 1)", 1, true))
+
+-- 弱引用的边不计入统计和增量
+local st = snapshot.stats(_G)
+local n = 0
+for _ in snapshot.nodes(S) do
+	n = n + 1
+end
+assert(n - weak == st.count)
+local S2 = snapshot.snapshot(_G, "_G")
+for i = 11, 20 do
+	cache["player" .. i] = players[i % 10 + 1]
+end
+local S3 = snapshot.snapshot(_G, "_G")
+for _ in snapshot.nodes(snapshot.incr(S2, S3), "weak") do
+	assert(false)
+end
@@ -0,0 +1,50 @@
+snapshot = require "snapshot"
+
+assert(snapshot.alloc_stats() == nil)
+assert(snapshot.track_alloc(true) == false)
+assert(snapshot.track_alloc(true) == true)
+
+local before = snapshot.alloc_stats()
+local keep = {}
+for i = 1, 1000 do
+	keep[i] = {}
+end
+local after = snapshot.alloc_stats()
+print(after.bytes, after.count, after.allocs, after.frees)
+for _, item in ipairs(after.types) do
+	print(item.type, item.count, item.size)
+end
+assert(after.allocs - before.allocs >= 1000)
+-- bytes与VM统计的内存一致
+local kb = collectgarbage("count")
+assert(math.abs(after.bytes / 1024 - kb) < 64)
+
+-- Lua 5.2及以上版本可以按新建对象的类型统计
+if _VERSION ~= "Lua 5.1" then
+	local tables = 0
+	for _, item in ipairs(after.types) do
+		if item.type == "table" then
+			tables = item.count
+		end
+	end
+	assert(tables >= 1000)
+end
+
+assert(snapshot.track_alloc(false) == true)
+assert(snapshot.alloc_stats() == nil)
+assert(snapshot.track_alloc(false) == false)
+-- 关闭统计后释放统计期间分配的内存
+keep = nil
+collectgarbage()
+-- 开启前分配的内存块在开启后释放，count为净增量，可以是负数
+local junk = {}
+for i = 1, 1000 do
+	junk[i] = {}
+end
+junk = nil
+-- 保持开启直到VM关闭，由哨兵恢复lua_Alloc
+snapshot.track_alloc(true)
+collectgarbage()
+local st = snapshot.alloc_stats()
+print(st.count, st.allocs, st.frees)
+assert(st.count < 0 and st.count == st.allocs - st.frees)
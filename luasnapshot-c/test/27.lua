@@ -0,0 +1,54 @@
+snapshot = require "snapshot"
+
+local function make_items(n)
+	local items = {}
+	for i = 1, n do
+		items[i] = { id = i }
+	end
+	return items
+end
+
+-- 采样间隔很小时几乎每个对象都会被采中
+snapshot.track_alloc(true, { sample = 64 })
+items = make_items(2000)
+local stats = snapshot.alloc_stats()
+print(stats.sample, stats.samples)
+assert(stats.sample == 64 and stats.samples > 0)
+
+local samples = snapshot.alloc_samples()
+assert(#samples > 0)
+local S = snapshot.snapshot()
+local sites = snapshot.alloc_sites(S)
+print(#samples, #sites)
+local found = 0
+for _, site in ipairs(sites) do
+	if site.link:find("_G%.items%.%[%d+%]") then
+		found = found + 1
+		-- LuaJIT不记录调用栈
+		if not jit then
+			assert(site.stack:find("27.lua"), site.stack)
+		end
+	end
+end
+print(found)
+assert(found > 100)
+print(sites[1].link, sites[1].type, sites[1].size, sites[1].stack)
+
+-- 关闭采样，不影响分配统计，已有的采样在对象释放后删除
+snapshot.track_alloc(true, { sample = false })
+local before = snapshot.alloc_stats()
+assert(before.sample == 0)
+items = nil
+S = nil
+samples = nil
+sites = nil
+collectgarbage()
+collectgarbage()
+local after = snapshot.alloc_stats()
+print(before.samples, after.samples)
+assert(after.samples < before.samples - 1000)
+
+local ok = pcall(snapshot.track_alloc, true, { sample = -1 })
+assert(not ok)
+assert(snapshot.track_alloc(false) == true)
+assert(snapshot.alloc_samples() == nil)
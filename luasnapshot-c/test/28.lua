@@ -0,0 +1,79 @@
+snapshot = require "snapshot"
+-- LuaJIT编译后的代码中不会触发count hook
+if jit then
+	jit.off()
+end
+
+local path = os.tmpname()
+local function exists(name)
+	local f = io.open(name, "rb")
+	if f == nil then
+		return false
+	end
+	local s = f:read("*a")
+	f:close()
+	return s
+end
+
+-- 水位很低时每次检查都会写入快照，文件环中只保留keep个文件
+assert(snapshot.watch({ threshold_kb = 1, cooldown_s = 0, path = path, keep = 2, check = 1000 }) == false)
+local items = {}
+for i = 1, 5000 do
+	items[i] = { id = i }
+end
+local s1 = exists(path .. ".1")
+local s2 = exists(path .. ".2")
+assert(s1 and s2 and not exists(path .. ".3"))
+print(s1:sub(1, 80))
+assert(s1:find('"memory_kb"') and s1:find('"types"'))
+
+-- 冷却时间内不再写入
+os.remove(path .. ".1")
+os.remove(path .. ".2")
+assert(snapshot.watch({ threshold_kb = 1, cooldown_s = 3600, path = path, keep = 2, check = 1000 }) == true)
+for i = 1, 5000 do
+	items[i] = { id = i }
+end
+assert(exists(path .. ".1") and not exists(path .. ".2"))
+os.remove(path .. ".1")
+
+-- 完整快照
+snapshot.watch({ threshold_kb = 1, cooldown_s = 3600, path = path, mode = "full", check = 1000 })
+for i = 1, 5000 do
+	items[i] = { id = i }
+end
+local full = exists(path .. ".1")
+assert(full and full:find('"link"'))
+os.remove(path .. ".1")
+
+-- 水位没有达到时不写入
+snapshot.watch({ threshold_kb = 1024 * 1024 * 1024, path = path, check = 1000 })
+for i = 1, 5000 do
+	items[i] = { id = i }
+end
+assert(not exists(path .. ".1"))
+
+assert(snapshot.watch(false) == true)
+assert(snapshot.watch(false) == false)
+assert(debug.gethook() == nil)
+
+-- check为0时不设置钩子，只在poll()中检查
+assert(snapshot.watch({ threshold_kb = 1, cooldown_s = 3600, path = path, check = 0 }) == false)
+assert(debug.gethook() == nil)
+for i = 1, 5000 do
+	items[i] = { id = i }
+end
+assert(not exists(path .. ".1"))
+assert(snapshot.poll() == true)
+assert(exists(path .. ".1"))
+-- 冷却时间内poll()不再写入
+assert(snapshot.poll() == false)
+assert(snapshot.watch(false) == true)
+assert(snapshot.poll() == false)
+os.remove(path .. ".1")
+assert(not pcall(snapshot.watch, { threshold_kb = 1, path = path, mode = "tree" }))
+-- 已经设置了其他钩子时报错
+debug.sethook(function() end, "", 1000)
+assert(not pcall(snapshot.watch, { threshold_kb = 1, path = path }))
+debug.sethook()
+os.remove(path)
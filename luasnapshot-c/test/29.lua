@@ -0,0 +1,74 @@
+snapshot = require "snapshot"
+-- LuaJIT编译后的代码中不会触发count hook
+if jit then
+	jit.off()
+end
+
+local path = os.tmpname()
+local function exists(name)
+	local f = io.open(name, "rb")
+	if f == nil then
+		return false
+	end
+	local s = f:read("*a")
+	f:close()
+	return s
+end
+-- os.execute中sh的父进程就是当前进程
+local function kill_self()
+	os.execute("kill -USR2 $PPID")
+end
+
+-- 没有收到信号时poll只检查标志
+assert(snapshot.poll() == false)
+
+-- check为0时只在poll()中处理
+assert(snapshot.on_signal({ path = path, check = 0 }) == false)
+assert(debug.gethook() == nil)
+kill_self()
+assert(not exists(path .. ".1"))
+assert(snapshot.poll() == true)
+local s = exists(path .. ".1")
+assert(s and s:find('"memory_kb"'))
+assert(snapshot.poll() == false)
+os.remove(path .. ".1")
+
+-- 设置钩子后在下一个安全点写入完整快照
+assert(snapshot.on_signal({ path = path, mode = "full", check = 1000 }) == true)
+kill_self()
+local items = {}
+for i = 1, 5000 do
+	items[i] = { id = i }
+end
+s = exists(path .. ".1")
+assert(s and s:find('"link"'))
+assert(snapshot.poll() == false)
+os.remove(path .. ".1")
+
+-- watch与on_signal共用钩子，停止其中一个时保留钩子
+snapshot.watch({ threshold_kb = 1024 * 1024 * 1024, path = path })
+assert(snapshot.on_signal(false) == true)
+assert(debug.gethook() ~= nil)
+snapshot.watch(false)
+assert(debug.gethook() == nil)
+assert(snapshot.on_signal(false) == false)
+os.remove(path)
+
+-- 主线程上有其他钩子时，在协程中开启也报错(LuaJIT的钩子是所有线程共用的)
+if not jit then
+	debug.sethook(function() end, "", 1000)
+	coroutine.wrap(function()
+		debug.sethook()
+		assert(not pcall(snapshot.on_signal, { path = path, check = 1000 }))
+	end)()
+	debug.sethook()
+	assert(snapshot.on_signal(false) == false)
+end
+
+-- 重复开启时沿用已安装的信号处理函数
+assert(snapshot.on_signal({ path = path, check = 0 }) == false)
+assert(snapshot.on_signal({ path = path, check = 0 }) == true)
+kill_self()
+assert(snapshot.poll() == true)
+assert(snapshot.on_signal(false) == true)
+os.remove(path .. ".1")
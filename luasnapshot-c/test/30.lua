@@ -0,0 +1,108 @@
+snapshot = require "snapshot"
+
+-- 用perl作为客户端，在后台连接控制通道并将结果写入文件
+if not os.execute("perl -MIO::Socket::UNIX -e 1 2>/dev/null") then
+	print("perl is required, skipped")
+	return
+end
+
+local sock = os.tmpname()
+local out = os.tmpname()
+-- snapshot命令只能在listen()指定的目录中写入文件
+local dir = os.tmpname()
+os.remove(dir)
+os.execute("mkdir " .. dir)
+local snap1 = "snap1"
+local snap2 = "snap2"
+local function read(name)
+	local f = io.open(name, "rb")
+	if f == nil then
+		return nil
+	end
+	local s = f:read("*a")
+	f:close()
+	return s
+end
+-- 发送命令，并在poll()中执行直到收到结果
+local function request(cmd)
+	os.remove(out)
+	os.execute(string.format([[(perl -MIO::Socket::UNIX -e '$s = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die; print $s "$ARGV[1]\n"; local $/; $r = <$s>; open(F, ">", "$ARGV[2].tmp"); print F $r; close F; rename("$ARGV[2].tmp", $ARGV[2])' '%s' '%s' '%s') &]],
+		sock, cmd, out))
+	local deadline = os.time() + 10
+	local s
+	repeat
+		snapshot.poll()
+		s = read(out)
+	until s ~= nil or os.time() > deadline
+	assert(s, "no response to " .. cmd)
+	return s
+end
+
+-- path是普通文件时不删除
+io.open(sock, "wb"):close()
+assert(not pcall(snapshot.listen, sock))
+assert(read(sock) == "")
+os.remove(sock)
+assert(snapshot.listen(sock, dir) == false)
+assert(not pcall(snapshot.listen, sock))
+-- 只允许同一用户连接
+local ok = os.execute(string.format('test "$(stat -c %%a %s)" = 600', sock))
+assert(ok == true or ok == 0)
+
+local s = request("stats")
+print(s:sub(1, 80))
+assert(s:find('^{"memory_kb"'))
+
+s = request("snapshot " .. snap1)
+assert(s == "ok " .. snap1 .. "\n")
+assert(read(dir .. "/" .. snap1):find('"link"'))
+assert(request("snapshot ../escape"):find("^error: Invalid snapshot name"))
+assert(request("snapshot " .. dir .. "/abs"):find("^error: Invalid snapshot name"))
+assert(read(dir .. "/abs") == nil)
+leak = {}
+for i = 1, 1000 do
+	leak[i] = { id = i }
+end
+request("snapshot " .. snap2)
+s = request("diff " .. snap1 .. " " .. snap2)
+print(s:sub(1, 80))
+assert(s:find('"key":"table"'))
+s = request("diff " .. snap1 .. " " .. snap2 .. " path 4")
+-- leak表和其中的1000个table归入同一个路径
+assert(s:find('"count":100[12],'))
+
+s = request("diff " .. snap1 .. " nowhere")
+assert(s:find("^error: "))
+s = request("bogus")
+assert(s:find("^error: Unknown command"))
+-- 只有空白字符的行直接关闭连接
+assert(request("\t") == "")
+
+s = request("drop " .. snap1)
+assert(s == "ok " .. snap1 .. "\n")
+assert(request("drop " .. snap1):find("^error: No snapshot"))
+assert(request("diff " .. snap1 .. " " .. snap2):find("^error: No snapshot"))
+-- 最多保存4个快照，超过时释放最早保存的snap2
+local snaps = {}
+for i = 1, 4 do
+	snaps[i] = "snaps" .. i
+	request("snapshot " .. snaps[i])
+end
+assert(request("diff " .. snap2 .. " " .. snaps[4]):find("^error: No snapshot"))
+assert(request("diff " .. snaps[1] .. " " .. snaps[4]):find('"key":'))
+for i = 1, 4 do
+	os.remove(dir .. "/" .. snaps[i])
+end
+
+-- 没有请求时poll只检查标志
+assert(snapshot.poll() == false)
+assert(snapshot.listen(false) == true)
+assert(snapshot.listen(false) == false)
+assert(read(sock) == nil)
+-- 停止后可以重新开启
+assert(snapshot.listen(sock) == false)
+snapshot.listen(false)
+os.remove(out)
+os.remove(dir .. "/" .. snap1)
+os.remove(dir .. "/" .. snap2)
+os.remove(dir)
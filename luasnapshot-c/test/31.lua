@@ -0,0 +1,90 @@
+snapshot = require "snapshot"
+
+local Item = { __name = "Item" }
+local Stable = { __name = "Stable" }
+stable = {}
+for i = 1, 50 do
+	stable[i] = setmetatable({}, Stable)
+end
+items = {}
+callbacks = {}
+
+assert(snapshot.leak_report() == nil)
+-- 不限制间隔和CPU时间，每次poll都统计
+assert(snapshot.leak_detect({ interval_s = 0, budget = 1, window = 4, check = 0 }) == false)
+assert(debug.gethook() == nil)
+for round = 1, 6 do
+	for i = 1, 100 do
+		items[#items + 1] = setmetatable({}, Item)
+		callbacks[#callbacks + 1] = function() return i end
+	end
+	assert(snapshot.poll() == true)
+end
+
+local report = snapshot.leak_report()
+print(report.captures, report.cost)
+assert(report.captures == 6)
+local found = {}
+for _, g in ipairs(report.growing) do
+	print(g.group, g.key, g.count, g.size, g.slope, g.size_slope, g.rate, g.samples)
+	assert(g.samples == 4)
+	found[g.group .. ":" .. g.key] = g
+	assert(g.key ~= "Stable")
+end
+assert(found["class:Item"] and math.abs(found["class:Item"].slope - 100) < 1e-6)
+assert(found["class:Item"].count == 600)
+assert(found["type:table"] and found["type:function"])
+local source = false
+for key, g in pairs(found) do
+	if key:find("^source:.*31%.lua") then
+		source = true
+	end
+end
+assert(source)
+
+-- 数量不再增长后不再报告
+for round = 1, 4 do
+	assert(snapshot.poll() == true)
+end
+report = snapshot.leak_report()
+for _, g in ipairs(report.growing) do
+	assert(g.key ~= "Item")
+end
+
+-- 窗口中途出现、之后不再增长的分组，和只增长了一次的分组都不报告
+local Late = { __name = "Late" }
+local Jump = { __name = "Jump" }
+jump = {}
+for i = 1, 10 do
+	jump[i] = setmetatable({}, Jump)
+end
+snapshot.leak_detect({ interval_s = 0, budget = 1, window = 6, check = 0 })
+for round = 1, 6 do
+	if round == 3 then
+		late = {}
+		for i = 1, 50 do
+			late[i] = setmetatable({}, Late)
+		end
+		for i = 11, 20 do
+			jump[i] = setmetatable({}, Jump)
+		end
+	end
+	assert(snapshot.poll() == true)
+end
+report = snapshot.leak_report()
+for _, g in ipairs(report.growing) do
+	assert(g.key ~= "Late" and g.key ~= "Jump")
+end
+
+-- 间隔内不统计
+snapshot.leak_detect({ interval_s = 3600, check = 0 })
+assert(snapshot.poll() == true)
+assert(snapshot.poll() == false)
+assert(snapshot.leak_report().captures == 1)
+
+assert(not pcall(snapshot.leak_detect, { budget = 0 }))
+assert(not pcall(snapshot.leak_detect, { window = 2 }))
+assert(snapshot.leak_detect(false) == true)
+assert(snapshot.leak_detect(false) == false)
+assert(snapshot.leak_report() == nil)
+assert(snapshot.poll() == false)
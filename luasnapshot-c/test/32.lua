@@ -0,0 +1,54 @@
+snapshot = require "snapshot"
+
+data = {}
+for i = 1, 2000 do
+	data[i] = { id = i, name = "item" .. i }
+end
+
+-- 不手动free()也不调用collectgarbage()，快照的native内存计入GC后，不再使用的快照会被及时回收
+collectgarbage()
+local alive = setmetatable({}, { __mode = "k" })
+for i = 1, 100 do
+	alive[snapshot.snapshot(_G, "_G")] = true
+end
+local n = 0
+for _ in pairs(alive) do
+	n = n + 1
+end
+print(n)
+-- Lua 5.1无法得知GC是否停止，不推进GC
+if _VERSION ~= "Lua 5.1" or jit then
+	assert(n < 50)
+end
+
+-- 宿主停止GC后快照不推进GC，待执行的__gc不会被执行
+local function finalized(f)
+	if newproxy then
+		local p = newproxy(true)
+		getmetatable(p).__gc = f
+		return p
+	end
+	return setmetatable({}, { __gc = f })
+end
+collectgarbage()
+collectgarbage("stop")
+local finalizers = 0
+for i = 1, 2000 do
+	finalized(function() finalizers = finalizers + 1 end)
+end
+for i = 1, 20 do
+	snapshot.snapshot(_G, "_G")
+end
+assert(finalizers == 0)
+collectgarbage("restart")
+collectgarbage()
+assert(finalizers == 2000)
+
+-- 所有快照都被回收后，节点的内存池归还给系统，之后仍然可以正常快照
+collectgarbage()
+collectgarbage()
+local S = snapshot.snapshot(_G, "_G")
+assert(snapshot.find_path(S, "_G.data.[2000]"))
+snapshot.free(S)
+local st = snapshot.stats()
+assert(st.count > 2000)
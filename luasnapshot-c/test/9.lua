@@ -0,0 +1,26 @@
+snapshot = require "snapshot"
+
+tmp = {
+    player = {
+        uid = 1,
+        camps = {
+            {campid = 1},
+            {campid = 2},
+        },
+    },
+}
+
+S1 = snapshot.snapshot(_G, "_G")
+snapshot.to_folded(S1, "count.folded")
+snapshot.to_folded(S1, "size.folded", "size")
+
+tmp.player.camps[3] = {campid = 3}
+S2 = snapshot.snapshot(_G, "_G")
+snapshot.to_folded(snapshot.incr(S1, S2), "incr.folded", "size")
+
+for _, name in ipairs({"count.folded", "size.folded", "incr.folded"}) do
+    print("================ " .. name .. " ================")
+    for line in io.lines(name) do
+        print(line)
+    end
+end